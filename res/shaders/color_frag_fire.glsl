@@ -1,45 +1,47 @@
 #version 330 core
 
-// uniform data
-uniform mat4 uProjectionMatrix;
-uniform mat4 uModelViewMatrix;
-uniform vec4 baseColor;
-uniform vec4 emColor;
-uniform vec4 amColor;
-uniform vec4 diffColor;
-uniform vec4 specColor;
-uniform float shininess;
-
 // viewspace data (this must match the output of the fragment shader)
 in VertexData {
-	vec3 position;
-	vec3 normal;
-	vec2 textureCoord;
+	vec3 center;
+	vec2 corner;
+	vec2 size;
+	flat vec4 baseColor;
+	flat vec4 emColor;
+	flat vec4 amColor;
+	flat vec4 diffColor;
+	flat vec4 specColor;
+	flat float shininess;
 } f_in;
 
 // framebuffer output
 out vec4 fb_color;
 
 void main() {
+	// shade the quad as the ellipsoid it stands in for
+	float r2 = dot(f_in.corner, f_in.corner);
+	if (r2 > 1) discard;
+	vec3 normal = vec3(f_in.corner, sqrt(1 - r2));
+	vec3 position = f_in.center + normal * vec3(f_in.size, min(f_in.size.x, f_in.size.y));
+
 	vec4 lightDir = vec4(0, 10, 0, 1);
 	
 	float ambientStrength = 0.1;
-	vec4 ambient = ambientStrength * amColor;
+	vec4 ambient = ambientStrength * f_in.amColor;
 	
-	vec4 norm = normalize(vec4(f_in.normal, 0));
+	vec4 norm = normalize(vec4(normal, 0));
 	lightDir = normalize(-lightDir);
 	
 	float diff = max(dot(norm, lightDir), 0.0);
-	vec4 diffuse = diff * diffColor;
+	vec4 diffuse = diff * f_in.diffColor;
 
 	//float specularStrength = 0.7;
 	vec4 reflectDir = reflect(-lightDir, norm);
-	vec4 viewDir = normalize(vec4(-f_in.position, 0));
+	vec4 viewDir = normalize(vec4(-position, 0));
 
 	float spec = pow(max(dot(viewDir, reflectDir), 0.5), 32);
-	vec4 specular = shininess * spec * specColor;
+	vec4 specular = f_in.shininess * spec * f_in.specColor;
 	
-	vec4 result = (emColor + ambient + diffuse + specular);
+	vec4 result = (f_in.emColor + ambient + diffuse + specular);
 
 	fb_color = result;
-}
\ No newline at end of file
+}
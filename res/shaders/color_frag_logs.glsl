@@ -1,8 +1,6 @@
 #version 330 core
 
 // uniform data
-uniform mat4 uProjectionMatrix;
-uniform mat4 uModelViewMatrix;
 uniform vec3 uColor;
 
 // viewspace data (this must match the output of the fragment shader)
@@ -1,33 +1,54 @@
 #version 330 core
 
-// uniform data
-uniform mat4 uProjectionMatrix;
-uniform mat4 uModelViewMatrix;
-uniform vec4 baseColor;
-uniform vec4 emColor;
-uniform vec4 amColor;
-uniform vec4 diffColor;
-uniform vec4 specColor;
-uniform float shininess;
+// per frame data, see cgra::frame_data
+layout(std140) uniform FrameData {
+	mat4 uProjectionMatrix;
+	mat4 uViewMatrix;
+	vec4 uLightDirection;
+	vec4 uLightColor;
+};
 
-// mesh data
-layout(location = 0) in vec3 aPosition;
-layout(location = 1) in vec3 aNormal;
-layout(location = 2) in vec2 aTexCoord;
+// instance data, one camera facing quad per particle
+layout(location = 0) in vec3 aLocation;
+layout(location = 1) in vec2 aSize;
+layout(location = 2) in vec4 aBaseColor;
+layout(location = 3) in vec4 aEmColor;
+layout(location = 4) in vec4 aAmColor;
+layout(location = 5) in vec4 aDiffColor;
+layout(location = 6) in vec4 aSpecColor;
+layout(location = 7) in float aShininess;
 
 // model data (this must match the input of the vertex shader)
 out VertexData {
-	vec3 position;
-	vec3 normal;
-	vec2 textureCoord;
+	vec3 center;
+	vec2 corner;
+	vec2 size;
+	flat vec4 baseColor;
+	flat vec4 emColor;
+	flat vec4 amColor;
+	flat vec4 diffColor;
+	flat vec4 specColor;
+	flat float shininess;
 } v_out;
 
 void main() {
-	// transform vertex data to viewspace
-	v_out.position = (uModelViewMatrix * vec4(aPosition, 1)).xyz;
-	v_out.normal = normalize((uModelViewMatrix * vec4(aNormal, 0)).xyz);
-	v_out.textureCoord = aTexCoord;
+	// corners of the quad as a triangle strip
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2 - 1;
+
+	// expand the quad in viewspace so it always faces the camera
+	vec3 center = (uViewMatrix * vec4(aLocation, 1)).xyz;
+	vec3 position = center + vec3(corner * aSize, 0);
+
+	v_out.center = center;
+	v_out.corner = corner;
+	v_out.size = aSize;
+	v_out.baseColor = aBaseColor;
+	v_out.emColor = aEmColor;
+	v_out.amColor = aAmColor;
+	v_out.diffColor = aDiffColor;
+	v_out.specColor = aSpecColor;
+	v_out.shininess = aShininess;
 
 	// set the screenspace position (needed for converting to fragment data)
-	gl_Position = uProjectionMatrix * uModelViewMatrix * vec4(aPosition, 1);
-}
\ No newline at end of file
+	gl_Position = uProjectionMatrix * vec4(position, 1);
+}
@@ -0,0 +1,64 @@
+#version 330 core
+
+// per frame data, see cgra::frame_data
+layout(std140) uniform FrameData {
+	mat4 uProjectionMatrix;
+	mat4 uViewMatrix;
+	vec4 uLightDirection;
+	vec4 uLightColor;
+};
+
+// uniform data
+uniform mat4 uModelMatrix;
+uniform sampler2D uHeightMap;
+uniform vec3 uCamera;      // in model space
+uniform float uPatchSize;  // grid cells along a patch edge
+uniform float uTexScale;   // model x/z to height map coordinates
+uniform vec2 uTexOffset;
+uniform float uCellSize;   // simulation cell, for the normals
+
+// patch grid, x and z are grid coordinates in [0, uPatchSize]
+layout(location = 0) in vec3 aPosition;
+
+// per patch data, see water_plane::lodInstance
+layout(location = 3) in vec4 aPatch;  // origin x, origin z, size
+layout(location = 4) in vec2 aMorph;  // start distance, 1 / morph length
+
+// model data (this must match the input of the vertex shader)
+out VertexData {
+	vec3 position;
+	vec3 normal;
+	vec2 textureCoord;
+} v_out;
+
+float height(vec2 p) {
+	return texture(uHeightMap, p * uTexScale + uTexOffset).r;
+}
+
+void main() {
+	float cell = aPatch.z / uPatchSize;
+	vec2 grid = aPosition.xz;
+	vec2 p = aPatch.xy + grid * cell;
+
+	// slide odd vertices onto their even neighbours as the patch nears its parent's range
+	float k = clamp((distance(uCamera, vec3(p.x, height(p), p.y)) - aMorph.x) * aMorph.y, 0, 1);
+	grid -= fract(grid * 0.5) * 2 * k;
+	p = aPatch.xy + grid * cell;
+
+	// same central differences as water_plane::surfaceNormal
+	vec3 pos = vec3(p.x, height(p), p.y);
+	float hl = height(p - vec2(uCellSize, 0));
+	float hr = height(p + vec2(uCellSize, 0));
+	float hd = height(p - vec2(0, uCellSize));
+	float hu = height(p + vec2(0, uCellSize));
+	vec3 normal = normalize(vec3(hl - hr, 1, hd - hu));
+
+	// transform vertex data to viewspace
+	mat4 modelView = uViewMatrix * uModelMatrix;
+	v_out.position = (modelView * vec4(pos, 1)).xyz;
+	v_out.normal = normalize((modelView * vec4(normal, 0)).xyz);
+	v_out.textureCoord = vec2(0);
+
+	// set the screenspace position (needed for converting to fragment data)
+	gl_Position = uProjectionMatrix * vec4(v_out.position, 1);
+}
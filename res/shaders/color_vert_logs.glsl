@@ -1,9 +1,15 @@
 #version 330 core
 
+// per frame data, see cgra::frame_data
+layout(std140) uniform FrameData {
+	mat4 uProjectionMatrix;
+	mat4 uViewMatrix;
+	vec4 uLightDirection;
+	vec4 uLightColor;
+};
+
 // uniform data
-uniform mat4 uProjectionMatrix;
-uniform mat4 uModelViewMatrix;
-uniform vec3 uColor;
+uniform mat4 uModelMatrix;
 
 // mesh data
 layout(location = 0) in vec3 aPosition;
@@ -19,10 +25,11 @@ out VertexData {
 
 void main() {
 	// transform vertex data to viewspace
-	v_out.position = (uModelViewMatrix * vec4(aPosition, 1)).xyz;
-	v_out.normal = normalize((uModelViewMatrix * vec4(aNormal, 0)).xyz);
+	mat4 modelView = uViewMatrix * uModelMatrix;
+	v_out.position = (modelView * vec4(aPosition, 1)).xyz;
+	v_out.normal = normalize((modelView * vec4(aNormal, 0)).xyz);
 	v_out.textureCoord = aTexCoord;
 
 	// set the screenspace position (needed for converting to fragment data)
-	gl_Position = uProjectionMatrix * uModelViewMatrix * vec4(aPosition, 1);
+	gl_Position = uProjectionMatrix * vec4(v_out.position, 1);
 }
\ No newline at end of file
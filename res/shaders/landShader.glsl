@@ -1,8 +1,14 @@
 #version 330 core
 
+// per frame data, see cgra::frame_data
+layout(std140) uniform FrameData {
+	mat4 uProjectionMatrix;
+	mat4 uViewMatrix;
+	vec4 uLightDirection;
+	vec4 uLightColor;
+};
+
 // uniform data
-uniform mat4 uProjectionMatrix;
-uniform mat4 uModelViewMatrix;
 uniform vec3 uColor;
 uniform float ambientStrength;
 uniform float specularStrength;
@@ -18,8 +24,8 @@ in VertexData {
 
  in vec3 pot_col;
 
-const vec3 lightDir = vec3(0.25, 0.25, -1);
-const vec3 lightColor = vec3(0.5,0.5,0.5);
+// the land keeps its own light, FrameData's direction is the one the water was tuned for
+const vec3 landLightDir = vec3(0.25, 0.25, -1);
 
 // framebuffer output
 out vec4 fb_color;
@@ -28,9 +34,10 @@ void main() {
 	
 	vec3 color = uColor;
 
+	vec3 lightColor = uLightColor.rgb;
 	vec3 ambient = ambientStrength * lightColor;
 	vec3 norm = normalize(f_in.normal);
-	vec3 lightDir = normalize(-lightDir);
+	vec3 lightDir = normalize(-landLightDir);
  	
 	float diff = max(dot(norm, lightDir), 0.0);
 	vec3 diffuse = diff * lightColor;
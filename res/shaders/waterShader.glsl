@@ -1,8 +1,14 @@
 #version 330 core
 
+// per frame data, see cgra::frame_data
+layout(std140) uniform FrameData {
+	mat4 uProjectionMatrix;
+	mat4 uViewMatrix;
+	vec4 uLightDirection;
+	vec4 uLightColor;
+};
+
 // uniform data
-uniform mat4 uProjectionMatrix;
-uniform mat4 uModelViewMatrix;
 uniform vec4 uColor;
 uniform float ambientStrength;
 uniform float specularStrength;
@@ -18,10 +24,6 @@ in VertexData {
 } f_in;
 
 
-const vec4 lightDir = vec4(0,-1,0,0);
-
-const vec4 lightColor = vec4(0.5,0.5,0.5,1);
-
 // framebuffer output
 out vec4 fb_color;
 
@@ -29,9 +31,10 @@ void main() {
 	//vec3 inpos = normalize(-f_in.position)
 	vec4 color = uColor;
 
+	vec4 lightColor = uLightColor;
 	vec4 ambient = ambientStrength * lightColor;
 	vec4 norm = vec4(normalize(f_in.normal),0);
-	vec4 lightDir = vec4(normalize(-lightDir));
+	vec4 lightDir = vec4(normalize(-uLightDirection));
  	
 	float diff = max(dot(norm, lightDir), 0.0);
 	vec4 diffuse = diff * lightColor;
@@ -1,6 +1,9 @@
 #pragma once
 // std
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <chrono>
 
@@ -14,6 +17,7 @@
 #include "cgra/cgra_geometry.hpp"
 #include "cgra/cgra_gui.hpp"
 #include "cgra/cgra_image.hpp"
+#include "cgra/cgra_resources.hpp"
 #include "cgra/cgra_shader.hpp"
 #include "cgra/cgra_wavefront.hpp"
 #include "water.hpp"
@@ -25,59 +29,63 @@ using namespace glm;
 
 
 
-void basic_model::draw(const glm::mat4& view, const glm::mat4 proj) {
-	mat4 modelview = view * modelTransform;
-	modelview = scale(modelview, vec3(30));
-	glUseProgram(shader); // load shader and variables
-	glUniformMatrix4fv(glGetUniformLocation(shader, "uProjectionMatrix"), 1, false, value_ptr(proj));
-	glUniformMatrix4fv(glGetUniformLocation(shader, "uModelViewMatrix"), 1, false, value_ptr(modelview));
-	glUniform3fv(glGetUniformLocation(shader, "uColor"), 1, value_ptr(this->color));
-	glUniform1f(glGetUniformLocation(shader, "ambientStrength"), 0.5);
-	glUniform1f(glGetUniformLocation(shader, "specularStrength"), 0.5);
+void basic_model::draw(const glm::mat4& /*view*/, const glm::mat4 /*proj*/) {
+	mat4 model = scale(modelTransform, vec3(30));
+	shader.use(); // load shader and variables, the camera comes from FrameData
+	shader.set_uniform(uModelMatrix, model);
+	shader.set_uniform(uColor, this->color);
+	shader.set_uniform(ambientStrength, 0.5f);
+	shader.set_uniform(specularStrength, 0.5f);
 
 	mesh.draw(); // draw
 }
 
+bool basic_model::visible(const cgra::frustum& clip) const {
+	return clip.transformed(scale(modelTransform, vec3(30))).intersects(mesh.bounds_min, mesh.bounds_max);
+}
+
 Application::Application(GLFWwindow *window) : m_window(window) {
 	
-	shader_builder sb;
-    sb.set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert.glsl"));
-	sb.set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//landShader.glsl"));
-	GLuint shader = sb.build();
+	// land, water, fire, logs and the water patches, built together so the driver can compile them in parallel
+	std::vector<shader_builder> sb(5);
+	sb[0].set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert.glsl"));
+	sb[0].set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//landShader.glsl"));
+	sb[1].set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert.glsl"));
+	sb[1].set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//waterShader.glsl"));
+	sb[2].set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert_fire.glsl"));
+	sb[2].set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_frag_fire.glsl"));
+	sb[3].set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert_logs.glsl"));
+	sb[3].set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_frag_logs.glsl"));
+	sb[4].set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert_lod.glsl"));
+	sb[4].set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//waterShader.glsl"));
+	const char *owners[] = { "scene", "water", "fire", "fire", "water" };
+	for (int i = 0; i < 5; i++) sb[i].set_owner(owners[i]);
+	m_programs = build_programs(sb);
+	shader_program shader = m_programs[0];
 
 
 	//Handles the water. All other water code is contained within water.h
-	shader_builder waterSB;
-	waterSB.set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert.glsl"));
-	waterSB.set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//waterShader.glsl"));
-	GLuint waterShader = waterSB.build();
-	water.shader = waterShader;
-	water.mesh = water.createSurface().build();
+	water.shader = m_programs[1];
+	water.lodShader = m_programs[4];
+	water.mesh = water.createSurface().build("water");
 
 	//Scene
 	scene.shader = shader;
-	scene.mesh = load_wavefront_data(CGRA_SRCDIR + std::string("\\res\\assets\\scene.obj")).build();
+	scene.mesh = load_wavefront_data(CGRA_SRCDIR + std::string("//res//assets//scene.obj")).build("scene");
 	scene.color = vec3(0, 1, 0.2);
 
 	//Fire 
-	sb.set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert_fire.glsl"));
-	sb.set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_frag_fire.glsl"));
-	GLuint shader_fire = sb.build();
-	
-	ps = ParticleSystem(shader_fire);
+	ps = ParticleSystem(m_programs[2]);
 	//secondary shader for logs 
-	sb.set_shader(GL_VERTEX_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_vert_logs.glsl"));
-	sb.set_shader(GL_FRAGMENT_SHADER, CGRA_SRCDIR + std::string("//res//shaders//color_frag_logs.glsl"));
-	GLuint shader_logs = sb.build();
-	ps.logShader = shader_logs;
+	ps.logShader = m_programs[3];
 }
 
 
 void Application::render() {
 	
 	// retrieve the window hieght
-	int width, height;
-	glfwGetFramebufferSize(m_window, &width, &height); 
+	int width = int(m_windowsize.x), height = int(m_windowsize.y);
+	if (m_window) glfwGetFramebufferSize(m_window, &width, &height);
 
 	m_windowsize = vec2(width, height); // update window size
 	glViewport(0, 0, width, height); // set the viewport to draw to the entire window
@@ -103,27 +111,76 @@ void Application::render() {
 		* rotate(mat4(1), m_yaw,   vec3(0, 1, 0));
 
 
+	// camera and light shared by every shader this frame
+	frame_data frame;
+	frame.projection = proj;
+	frame.view = view;
+	upload_frame_data(frame);
+
+	// view volume for culling, shared by the water, the scene and the fire
+	cgra::frustum clip(proj * view);
+	m_culledModels = 0;
+
 	// helpful draw options
-	if (m_show_grid) drawGrid(view, proj);
-	if (m_show_axis) drawAxis(view, proj);
+	if (m_show_grid) drawGrid();
+	if (m_show_axis) drawAxis();
 	glPolygonMode(GL_FRONT_AND_BACK, (m_showWireframe) ? GL_LINE : GL_FILL);
 
 
 	// draw the water
-	water.simulate();
+	if (m_playback) updatePlayback();
+	else if (m_fixedFrameTime > 0) {
+		if (m_waveInterval > 0 && m_frameCount % m_waveInterval == 0) water.randWave();
+		water.tick();
+		water.updateSurface();
+	}
+	else water.simulate();
 	if (water.viz) {
 		water.visualize(view, proj);
 	}
-	water.draw(view, proj);
+	water.draw(view, proj, clip);
 	
 
 	// Draw the scene
-	//scene.draw(view,proj);
+	if (scene.visible(clip)) scene.draw(view, proj);
+	else m_culledModels++;
 
 	//draw fire 
-	//ps.parameters(fire_radius, wind_factor, fire_density, fire_scale, lrg_wind, fire_height, alpha);
-	//ps.update();
-	//ps.draw(view, proj);
+	ps.parameters(fire_radius, wind_factor, fire_density, fire_scale, lrg_wind, fire_height, alpha);
+	ps.update();
+	ps.draw(clip);
+
+	// read back the frame (before the GUI) if recording
+	m_capture.frame(ivec2(width, height));
+	m_frameCount++;
+}
+
+
+void Application::setFixedStep(double frameTime, int waveInterval) {
+	m_fixedFrameTime = frameTime;
+	m_waveInterval = waveInterval;
+	m_frameCount = 0;
+	m_playbackTime = 0;
+	m_lastFrameTime = frameClock();
+}
+
+
+double Application::frameClock() const {
+	if (m_fixedFrameTime > 0) return m_frameCount * m_fixedFrameTime;
+	return glfwGetTime();
+}
+
+
+void Application::shutdown() {
+	m_capture.stop_recording();
+	m_capture.finish();
+
+	water.releaseGL();
+	scene.mesh.destroy();
+	ps.releaseGL();
+	for (shader_program &p : m_programs) p.destroy();
+	releaseGeometry();
+	release_frame_data();
 }
 
 
@@ -147,9 +204,26 @@ void Application::renderGUI() {
 	ImGui::Checkbox("Wireframe", &m_showWireframe);
 	ImGui::Checkbox("Playing", &water.playing);
 	ImGui::SameLine();
-	if (ImGui::Button("Screenshot")) rgba_image::screenshot(true);
+	if (ImGui::Button("Screenshot")) {
+		ostringstream filename;
+		filename << "screenshot_" << (chrono::system_clock::now().time_since_epoch() / 1ms);
+		m_capture.screenshot(ivec2(m_windowsize), filename.str());
+	}
 	if (ImGui::Button("GenerateWave")) water.randWave();
+	ImGui::SameLine();
+	if (ImGui::Button("GenerateSwell")) water.randWave(4 * water.radius);
+	if (ImGui::SliderInt("Bands", &water.bands, 1, 4)) water.resize(water.n);
 	ImGui::SliderFloat("Roughness", &water.roughness, 1, 25, "%.2f");
+	if (ImGui::Checkbox("Periodic", &water.periodic)) water.resize(water.n);
+	if (water.periodic) ImGui::SliderInt("Repeat", &water.repeat, 0, 4);
+	if (ImGui::Checkbox("LOD surface", &water.lod)) water.invalidateSurface();
+	if (water.lod) {
+		ImGui::SameLine();
+		ImGui::Text("%d triangles", water.lodTriangles);
+		ImGui::SliderFloat("LOD pixels", &water.lodPixels, 1, 16, "%.1f");
+	}
+	ImGui::Text("Culled: %d water %s, %d models, %d emitters", water.culledTiles, water.lod ? "patches" : "tiles", m_culledModels, ps.culledEmitters);
+	ImGui::Checkbox("GPU memory", &m_showGpuMemory);
 	ImGui::Separator();
 
 	// example of how to use input boxes
@@ -159,15 +233,179 @@ void Application::renderGUI() {
 	}
 
 	//Fire paremeters
-	//ImGui::SliderFloat("Wind factor", &wind_factor, -5, 5, "%.2f");
-	//ImGui::SliderFloat("Large wind field", &lrg_wind, -1, 1, "%.2f");
-	//ImGui::SliderFloat("Fire density", &fire_density, 10, 125, "%.2f");
-	//ImGui::SliderFloat("Particle scale", &fire_scale, 0.01, 0.85, "%.2f");
-	//ImGui::SliderFloat("Gravity scalar", &fire_height, 0.5, 5, "%.2f");
-	//ImGui::Checkbox("Transparency", &alpha);
+	ImGui::SliderFloat("Wind factor", &wind_factor, -5, 5, "%.2f");
+	ImGui::SliderFloat("Large wind field", &lrg_wind, -1, 1, "%.2f");
+	ImGui::SliderFloat("Fire density", &fire_density, 10, 125, "%.2f");
+	ImGui::SliderFloat("Particle scale", &fire_scale, 0.01, 0.85, "%.2f");
+	ImGui::SliderFloat("Gravity scalar", &fire_height, 0.5, 5, "%.2f");
+	ImGui::Checkbox("Transparency", &alpha);
 	ImGui::Checkbox("visualize particles", &water.viz);
+
+	// checkpoint of the simulation state
+	ImGui::Separator();
+	ImGui::InputText("Checkpoint", m_checkpointPath, sizeof(m_checkpointPath));
+	if (ImGui::Button("Save state")) {
+		try { water.saveState(m_checkpointPath); }
+		catch (std::exception &e) { cerr << e.what() << endl; }
+	}
+	ImGui::SameLine();
+	if (ImGui::Button("Load state")) {
+		try { water.loadState(m_checkpointPath); }
+		catch (std::exception &e) { cerr << e.what() << endl; }
+	}
+
+	// recording every frame
+	ImGui::Separator();
+	ImGui::InputText("Capture", m_capturePath, sizeof(m_capturePath));
+	if (m_capture.recording()) {
+		if (ImGui::Button("Stop recording")) m_capture.stop_recording();
+		ImGui::SameLine();
+		ImGui::Text("%lld frames", (long long)m_capture.frames_recorded());
+	}
+	else {
+		if (ImGui::Button("Record")) {
+			try { m_capture.start_recording(m_capturePath, m_captureRaw ? frame_capture::raw_stream : frame_capture::png_sequence); }
+			catch (std::exception &e) { cerr << e.what() << endl; }
+		}
+		ImGui::SameLine();
+		ImGui::Checkbox("Raw RGBA stream", &m_captureRaw);
+	}
+
+	// baked playback
+	ImGui::Separator();
+	ImGui::InputText("Sequence", m_playbackPath, sizeof(m_playbackPath));
+	if (m_playback) {
+		if (ImGui::Button("Stop playback")) m_playback.reset();
+	}
+	else if (ImGui::Button("Play sequence")) {
+		loadPlayback(m_playbackPath);
+	}
+	ImGui::SliderFloat("Playback rate", &m_playbackRate, -4, 4, "%.2f");
+	if (m_playback) ImGui::Text("Frame %d / %d", m_frameIndex[0], m_playback->frameCount());
 	// finish creating window
 	ImGui::End();
+
+	renderGpuMemory();
+}
+
+
+/*
+Window with the GPU memory held by each owner, against the budget if one is set,
+and a plot of the total over the last frames so steady growth stands out.
+*/
+void Application::renderGpuMemory() {
+	float total = gpu_bytes() / 1048576.f;
+	m_gpuHistory[m_gpuHistoryNext] = total;
+	m_gpuHistoryNext = (m_gpuHistoryNext + 1) % gpuHistoryLength;
+	if (!m_showGpuMemory) return;
+
+	ImGui::SetNextWindowPos(ImVec2(310, 5), ImGuiSetCond_Once);
+	ImGui::SetNextWindowSize(ImVec2(280, 240), ImGuiSetCond_Once);
+	ImGui::Begin("GPU memory", &m_showGpuMemory);
+
+	char label[64];
+	if (gpu_budget()) {
+		float budget = gpu_budget() / 1048576.f;
+		snprintf(label, sizeof(label), "%.1f / %.0f MB", total, budget);
+		if (gpu_over_budget()) ImGui::PushStyleColor(ImGuiCol_PlotHistogram, ImVec4(0.9f, 0.2f, 0.2f, 1));
+		ImGui::ProgressBar(std::min(total / budget, 1.f), ImVec2(-1, 0), label);
+		if (gpu_over_budget()) ImGui::PopStyleColor();
+	}
+	else {
+		snprintf(label, sizeof(label), "%.1f MB", total);
+	}
+	ImGui::PlotLines("##gpu history", m_gpuHistory, gpuHistoryLength, m_gpuHistoryNext, label, 0, FLT_MAX, ImVec2(-1, 40));
+
+	ImGui::Columns(3, "gpu owners");
+	ImGui::Text("Owner"); ImGui::NextColumn();
+	ImGui::Text("Objects"); ImGui::NextColumn();
+	ImGui::Text("MB"); ImGui::NextColumn();
+	ImGui::Separator();
+	for (const gpu_usage &u : gpu_usage_by_owner()) {
+		ImGui::Text("%s", u.owner.c_str()); ImGui::NextColumn();
+		ImGui::Text("%d", u.objects); ImGui::NextColumn();
+		ImGui::Text("%.2f", u.bytes / 1048576.f); ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+
+	// what the driver has left, where it says
+	if (GLEW_NVX_gpu_memory_info) {
+		GLint available = 0;
+		glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &available);
+		ImGui::Text("Driver: %.0f MB available", available / 1024.f);
+	}
+	ImGui::End();
+}
+
+
+bool Application::loadPlayback(const std::string &filename) {
+	try {
+		m_playback.reset(new height_sequence_reader(filename));
+	}
+	catch (std::exception &e) {
+		cerr << e.what() << endl;
+		m_playback.reset();
+		return false;
+	}
+	if (m_playback->size() != water.n) water.resize(m_playback->size());
+	m_playbackTime = 0;
+	m_lastFrameTime = frameClock();
+	m_frameIndex[0] = m_frameIndex[1] = -1;
+	for (auto &f : m_frames) f.resize(water.n * water.n);
+	m_blended.resize(water.n * water.n);
+	return true;
+}
+
+
+/*
+Advances playback by the wall clock time since the last frame, blends the two frames
+around the current time and pushes the result through the water mesh.
+*/
+void Application::updatePlayback() {
+	double now = frameClock();
+	m_playbackTime += (now - m_lastFrameTime) * m_playbackRate;
+	m_lastFrameTime = now;
+
+	int count = m_playback->frameCount();
+	double length = count * double(m_playback->frameTime());
+	m_playbackTime = fmod(m_playbackTime, length);
+	if (m_playbackTime < 0) m_playbackTime += length;
+
+	double frame = m_playbackTime / m_playback->frameTime();
+	int i0 = int(frame) % count;
+	int i1 = (i0 + 1) % count;
+	float t = float(frame - floor(frame));
+
+	// reuse whichever frames are already decoded, a damaged frame stops playback
+	try {
+		if (m_frameIndex[0] != i0) {
+			if (m_frameIndex[1] == i0) {
+				swap(m_frames[0], m_frames[1]);
+				swap(m_frameIndex[0], m_frameIndex[1]);
+			}
+			else {
+				m_frameIndex[0] = -1;
+				m_playback->decode(i0, m_frames[0].data());
+				m_frameIndex[0] = i0;
+			}
+		}
+		if (m_frameIndex[1] != i1) {
+			m_frameIndex[1] = -1;
+			m_playback->decode(i1, m_frames[1].data());
+			m_frameIndex[1] = i1;
+		}
+	}
+	catch (std::exception &e) {
+		cerr << e.what() << endl;
+		m_playback.reset();
+		return;
+	}
+
+	for (size_t i = 0; i < m_blended.size(); i++) {
+		m_blended[i] = m_frames[0][i] + (m_frames[1][i] - m_frames[0][i]) * t;
+	}
+	water.setHeights(m_blended.data());
+	water.updateSurface();
 }
 
 
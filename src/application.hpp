@@ -1,3 +1,8 @@
+#pragma once
+
+// std
+#include <memory>
+#include <vector>
 
 // glm
 #include <glm/glm.hpp>
@@ -5,21 +10,32 @@
 
 // project
 #include "opengl.hpp"
+#include "cgra/cgra_capture.hpp"
 #include "cgra/cgra_mesh.hpp"
 #include "skeleton_model.hpp"
 #include "particle_system.hpp"
+#include "height_sequence.hpp"
 
 // Basic model that holds the shader, mesh and transform for drawing.
 // Can be copied and modified for adding in extra information for drawing
 // including textures for texture mapping etc.
 struct basic_model {
-	GLuint shader = 0;
+	cgra::shader_program shader;
 	cgra::gl_mesh mesh;
 	glm::vec3 color = glm::vec3(0,0,0);
 	glm::mat4 modelTransform{ 1.0 };
 	GLuint texture;
 
+	// uniforms draw() sets on shader
+	cgra::shader_uniform uModelMatrix{ "uModelMatrix" };
+	cgra::shader_uniform uColor{ "uColor" };
+	cgra::shader_uniform ambientStrength{ "ambientStrength" };
+	cgra::shader_uniform specularStrength{ "specularStrength" };
+
 	void draw(const glm::mat4& view, const glm::mat4 proj);
+
+	// false if the mesh bounds are entirely outside clip, the world space view volume
+	bool visible(const cgra::frustum& clip) const;
 };
 
 
@@ -45,9 +61,19 @@ private:
 	bool m_show_grid = false;
 	bool m_showWireframe = false;
 
+	// models left out by frustum culling in the last frame
+	int m_culledModels = 0;
+
+	// fixed frame clock for batch rendering, 0 follows the wall clock
+	double m_fixedFrameTime = 0;
+	int m_waveInterval = 0; // frames between random waves with a fixed clock
+	long long m_frameCount = 0;
+	double frameClock() const;
+
 	// geometry
 	basic_model scene;
 	ParticleSystem ps;
+	std::vector<cgra::shader_program> m_programs; // deleted by shutdown()
 
 	//fire parameters
 	float fire_radius = 1.0;
@@ -58,14 +84,55 @@ private:
 	float fire_height = 2.5;
 	bool alpha = false;
 
+	// playback of a baked height sequence instead of simulating
+	std::unique_ptr<height_sequence_reader> m_playback;
+	char m_playbackPath[256] = "water.wphs";
+	float m_playbackRate = 1;
+	double m_playbackTime = 0;
+	double m_lastFrameTime = 0;
+	int m_frameIndex[2] = { -1, -1 };
+	std::vector<float> m_frames[2];
+	std::vector<float> m_blended;
+	void updatePlayback();
+
+	// simulation checkpoint
+	char m_checkpointPath[256] = "water.wpck";
+
+	// screenshots and frame recording, read back asynchronously
+	cgra::frame_capture m_capture;
+	char m_capturePath[256] = "capture";
+	bool m_captureRaw = false;
+
+	// overlay of the tracked GPU memory (see cgra_resources.hpp) and its recent history in MB
+	bool m_showGpuMemory = false;
+	static const int gpuHistoryLength = 120;
+	float m_gpuHistory[gpuHistoryLength] = {};
+	int m_gpuHistoryNext = 0;
+	void renderGpuMemory();
+
 public:
-	// setup
+	// setup, the window may be null when rendering offscreen (see setFramebufferSize)
 	Application(GLFWwindow*);
 
 	// disable copy constructors (for safety)
 	Application(const Application&) = delete;
 	Application& operator=(const Application&) = delete;
 
+	// starts playing back a height sequence, returns false if it could not be loaded
+	bool loadPlayback(const std::string &filename);
+
+	// finishes the captures and deletes every GL object the application made,
+	// call before the context is destroyed
+	void shutdown();
+
+	// batch rendering: size of the framebuffer render() draws to when there is no window,
+	// the camera, and a fixed step that ticks the water (adding a random wave every
+	// waveInterval frames) and advances playback once per frame. Setting the step restarts
+	// the frame clock at 0, so load playback after it.
+	void setFramebufferSize(int width, int height) { m_windowsize = glm::vec2(width, height); }
+	void setCamera(float pitch, float yaw, float distance) { m_pitch = pitch; m_yaw = yaw; m_distance = distance; }
+	void setFixedStep(double frameTime, int waveInterval);
+
 	// rendering callbacks (every frame)
 	void render();
 	void renderGUI();
@@ -0,0 +1,228 @@
+// std
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+// glm
+#include <glm/gtc/constants.hpp>
+
+// project
+#include "batch_render.hpp"
+#include "cgra/cgra_capture.hpp"
+#include "cgra/cgra_resources.hpp"
+
+#ifdef CGRA_HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+
+using namespace std;
+
+
+vector<camera_key> loadCameraPath(const string &filename) {
+	ifstream file(filename);
+	if (!file) {
+		cerr << "Error: Could not open camera path " << filename << endl;
+		throw runtime_error("Error: Could not open camera path " + filename);
+	}
+
+	vector<camera_key> path;
+	string line;
+	for (int number = 1; getline(file, line); number++) {
+		if (line.find_first_not_of(" \t\r") == string::npos || line[line.find_first_not_of(" \t")] == '#') continue;
+		istringstream in(line);
+		camera_key key;
+		if (!(in >> key.time >> key.pitch >> key.yaw >> key.distance) || (!path.empty() && key.time < path.back().time)) {
+			cerr << "Error: Bad camera key on line " << number << " of " << filename << endl;
+			throw runtime_error("Error: Bad camera key in " + filename);
+		}
+		path.push_back(key);
+	}
+	if (path.empty()) {
+		cerr << "Error: Camera path " << filename << " has no keys" << endl;
+		throw runtime_error("Error: Camera path " + filename + " has no keys");
+	}
+	return path;
+}
+
+
+camera_key sampleCameraPath(const vector<camera_key> &path, float t) {
+	if (t <= path.front().time) return path.front();
+	if (t >= path.back().time) return path.back();
+	auto next = upper_bound(path.begin(), path.end(), t, [](float t, const camera_key &k) { return t < k.time; });
+	const camera_key &a = *(next - 1);
+	const camera_key &b = *next;
+	float s = (b.time > a.time) ? (t - a.time) / (b.time - a.time) : 1;
+	camera_key k;
+	k.time = t;
+	k.pitch = a.pitch + (b.pitch - a.pitch) * s;
+	k.yaw = a.yaw + (b.yaw - a.yaw) * s;
+	k.distance = a.distance + (b.distance - a.distance) * s;
+	return k;
+}
+
+
+int runBatch(Application &application, const batch_options &options) {
+	if (!(options.frameTime > 0)) {
+		cerr << "Error: The frame time must be positive" << endl;
+		return 1;
+	}
+
+	vector<camera_key> path;
+	if (!options.cameraPath.empty()) {
+		path = loadCameraPath(options.cameraPath);
+	}
+	else {
+		// one turn around the water from the interactive camera's starting point
+		camera_key start;
+		start.pitch = .86f;
+		start.yaw = -.86f;
+		camera_key end = start;
+		end.time = options.frames * options.frameTime;
+		end.yaw += 2 * glm::pi<float>();
+		path = { start, end };
+	}
+
+	// colour and depth renderbuffers to draw into instead of a window
+	GLuint fbo = 0, color = 0, depth = 0;
+	size_t pixels = size_t(options.width) * options.height;
+	glGenFramebuffers(1, &fbo);
+	CGRA_GPU_TRACK(cgra::gpu_kind::framebuffer, fbo, "batch");
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glGenRenderbuffers(1, &color);
+	CGRA_GPU_TRACK(cgra::gpu_kind::renderbuffer, color, "batch", "colour");
+	glBindRenderbuffer(GL_RENDERBUFFER, color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, options.width, options.height);
+	cgra::gpu_resize(cgra::gpu_kind::renderbuffer, color, pixels * 4);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+	glGenRenderbuffers(1, &depth);
+	CGRA_GPU_TRACK(cgra::gpu_kind::renderbuffer, depth, "batch", "depth");
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, options.width, options.height);
+	cgra::gpu_resize(cgra::gpu_kind::renderbuffer, depth, pixels * 4); // 24 bit depth is padded to 32
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	auto release = [&] {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		cgra::gpu_release(cgra::gpu_kind::framebuffer, fbo);
+		cgra::gpu_release(cgra::gpu_kind::renderbuffer, color);
+		cgra::gpu_release(cgra::gpu_kind::renderbuffer, depth);
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteRenderbuffers(1, &color);
+		glDeleteRenderbuffers(1, &depth);
+	};
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		cerr << "Error: Offscreen framebuffer is incomplete" << endl;
+		release();
+		return 1;
+	}
+
+	application.setFramebufferSize(options.width, options.height);
+	application.setFixedStep(options.frameTime, options.waveInterval);
+	if (!options.playback.empty() && !application.loadPlayback(options.playback)) {
+		release();
+		return 1;
+	}
+	cgra::frame_capture capture;
+	if (!options.output.empty()) capture.start_recording(options.output, cgra::frame_capture::png_sequence);
+
+	// frame times include waiting for the GPU, but not the readback
+	vector<double> times;
+	for (int f = 0; f < options.frames; f++) {
+		camera_key camera = sampleCameraPath(path, f * options.frameTime);
+		application.setCamera(camera.pitch, camera.yaw, camera.distance);
+
+		auto start = chrono::steady_clock::now();
+		application.render();
+		glFinish();
+		times.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+
+		capture.frame(glm::ivec2(options.width, options.height));
+	}
+	capture.stop_recording();
+	capture.finish();
+	release();
+
+	if (!options.timings.empty()) {
+		ofstream csv(options.timings);
+		if (!csv) {
+			cerr << "Error: Could not open " << options.timings << " for writing" << endl;
+			return 1;
+		}
+		csv << "frame,ms" << endl;
+		for (size_t f = 0; f < times.size(); f++) csv << f << "," << times[f] << endl;
+	}
+
+	if (!times.empty()) {
+		vector<double> sorted = times;
+		sort(sorted.begin(), sorted.end());
+		double total = 0;
+		for (double t : times) total += t;
+		cout << "Rendered " << times.size() << " frames at " << options.width << "x" << options.height
+			<< ": mean " << total / times.size() << " ms, median " << sorted[sorted.size() / 2]
+			<< " ms, 95th " << sorted[min(sorted.size() - 1, sorted.size() * 95 / 100)]
+			<< " ms, max " << sorted.back() << " ms" << endl;
+	}
+	return 0;
+}
+
+
+#ifdef CGRA_HAVE_EGL
+
+namespace {
+	EGLDisplay egl_display = EGL_NO_DISPLAY;
+	EGLContext egl_context = EGL_NO_CONTEXT;
+}
+
+
+bool createEglContext() {
+	// Mesa's surfaceless platform needs no display server, otherwise try the default display
+	auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (getPlatformDisplay && extensions && strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+		egl_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	}
+	if (egl_display == EGL_NO_DISPLAY) egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API)) {
+		cerr << "Error: Could not initialize EGL" << endl;
+		return false;
+	}
+
+	const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config = nullptr;
+	EGLint configs = 0;
+	eglChooseConfig(egl_display, configAttribs, &config, 1, &configs);
+
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	egl_context = eglCreateContext(egl_display, configs ? config : nullptr, EGL_NO_CONTEXT, contextAttribs);
+	if (egl_context == EGL_NO_CONTEXT || !eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context)) {
+		cerr << "Error: Could not create a surfaceless EGL context (0x" << hex << eglGetError() << dec << ")" << endl;
+		destroyEglContext();
+		return false;
+	}
+	return true;
+}
+
+
+void destroyEglContext() {
+	if (egl_display == EGL_NO_DISPLAY) return;
+	eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (egl_context != EGL_NO_CONTEXT) eglDestroyContext(egl_display, egl_context);
+	eglTerminate(egl_display);
+	egl_display = EGL_NO_DISPLAY;
+	egl_context = EGL_NO_CONTEXT;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+// std
+#include <string>
+#include <vector>
+
+// project
+#include "application.hpp"
+
+
+// One key of a scripted camera path, in the orbital camera's terms.
+struct camera_key {
+	float time = 0; // seconds
+	float pitch = 0; // radians
+	float yaw = 0; // radians
+	float distance = 20;
+};
+
+// Reads a camera path with one key per line as "time pitch yaw distance".
+// Keys must be in time order, blank lines and lines starting with '#' are skipped.
+std::vector<camera_key> loadCameraPath(const std::string &filename);
+
+// Camera at time t, interpolated linearly between keys and held past either end.
+camera_key sampleCameraPath(const std::vector<camera_key> &path, float t);
+
+
+struct batch_options {
+	int frames = 120;
+	int width = 800;
+	int height = 600;
+	float frameTime = 1 / 30.f; // simulation and camera time per frame
+	int waveInterval = 10; // frames between random waves, 0 for none
+	std::string cameraPath; // empty orbits once around the default camera
+	std::string playback; // height sequence to play back instead of simulating, empty for none
+	std::string output = "batch"; // prefix of the numbered PNGs, empty writes none
+	std::string timings; // CSV of the time every frame took, empty writes none
+};
+
+// Renders frames of the application into an offscreen framebuffer on the current
+// context and writes them out, then prints the frame times. The water ticks once per
+// frame (or playback advances by frameTime) so runs are repeatable. Returns 0 on success.
+int runBatch(Application &application, const batch_options &options);
+
+
+#ifdef CGRA_HAVE_EGL
+
+// Creates a surfaceless OpenGL 3.3 core context through EGL and makes it current, for
+// machines without a display server (Mesa's llvmpipe needs no GPU either).
+// Returns false if no such context can be made.
+bool createEglContext();
+void destroyEglContext();
+
+#endif
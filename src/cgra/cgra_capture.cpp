@@ -0,0 +1,221 @@
+// std
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+// stb
+#include <stb_image_write.h>
+
+// project
+#include "cgra_capture.hpp"
+#include "cgra_resources.hpp"
+
+
+using namespace std;
+
+namespace cgra {
+
+	frame_capture::frame_capture(int ring_size, int threads) : m_ring(max(ring_size, 1)) {
+		if (threads <= 0) threads = max(int(thread::hardware_concurrency()) - 1, 1);
+		// enough queued frames to ride out a slow write, few enough to bound the memory held
+		m_max_jobs = 2 * threads + m_ring.size();
+		for (int i = 0; i < threads; i++) m_workers.emplace_back(&frame_capture::work, this);
+	}
+
+
+	frame_capture::~frame_capture() {
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_done.wait(lock, [&] { return m_busy == 0; });
+			m_stopping = true;
+		}
+		m_wake.notify_all();
+		for (thread &t : m_workers) t.join();
+	}
+
+
+	void frame_capture::work() {
+		while (true) {
+			function<void()> job;
+			{
+				unique_lock<mutex> lock(m_mutex);
+				m_wake.wait(lock, [&] { return m_stopping || !m_jobs.empty(); });
+				if (m_jobs.empty()) return;
+				job = move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+			job();
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_busy--;
+			}
+			m_done.notify_all();
+		}
+	}
+
+
+	void frame_capture::submit(function<void()> job) {
+		{
+			// block rather than drop frames when the encoders fall behind
+			unique_lock<mutex> lock(m_mutex);
+			m_done.wait(lock, [&] { return m_busy < m_max_jobs; });
+			m_jobs.push_back(move(job));
+			m_busy++;
+		}
+		m_wake.notify_one();
+	}
+
+
+	void frame_capture::read(glm::ivec2 size, const string &filename, int64_t frame) {
+		// reuse the oldest slot, waiting for it if the whole ring is still in flight
+		slot &s = m_ring[m_next];
+		if (s.fence) collect(s);
+		m_next = (m_next + 1) % m_ring.size();
+
+		size_t bytes = size_t(size.x) * size.y * 4;
+		if (!s.pbo) {
+			glGenBuffers(1, &s.pbo);
+			CGRA_GPU_TRACK(gpu_kind::buffer, s.pbo, "capture", "readback");
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+		if (bytes > s.capacity) {
+			glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+			s.capacity = bytes;
+			gpu_resize(gpu_kind::buffer, s.pbo, bytes);
+		}
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		s.size = size;
+		s.filename = filename;
+		s.frame = frame;
+	}
+
+
+	void frame_capture::collect(slot &s) {
+		while (glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000) == GL_TIMEOUT_EXPIRED) { }
+		glDeleteSync(s.fence);
+		s.fence = nullptr;
+
+		// copy out flipped so the top row comes first, the buffer is free again after this
+		size_t row = size_t(s.size.x) * 4;
+		auto pixels = make_shared<vector<unsigned char>>(row * s.size.y);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+		const unsigned char *mapped = static_cast<const unsigned char *>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pixels->size(), GL_MAP_READ_BIT));
+		if (mapped) {
+			for (int y = 0; y < s.size.y; y++) {
+				memcpy(pixels->data() + y * row, mapped + (s.size.y - 1 - y) * row, row);
+			}
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		if (!mapped) {
+			// a lost raw frame still has to take its turn or the ones after it would wait forever
+			cerr << "Error: Could not map captured frame" << endl;
+			pixels->clear();
+		}
+
+		glm::ivec2 size = s.size;
+		if (!s.filename.empty()) {
+			string filename = s.filename;
+			submit([=] {
+				if (pixels->empty()) return;
+				if (stbi_write_png(filename.c_str(), size.x, size.y, 4, pixels->data(), size.x * 4)) {
+					cout << "Wrote image " << filename << endl;
+				} else {
+					cerr << "Error: Failed to write image " << filename << endl;
+				}
+			});
+		}
+		else {
+			int64_t frame = s.frame;
+			submit([=] {
+				// appended in frame order, whichever worker got to them first
+				unique_lock<mutex> lock(m_mutex);
+				m_done.wait(lock, [&] { return m_written == frame; });
+				m_stream.write(reinterpret_cast<const char *>(pixels->data()), pixels->size());
+				m_written++;
+				lock.unlock();
+				m_done.notify_all();
+			});
+		}
+	}
+
+
+	void frame_capture::screenshot(glm::ivec2 size, const string &filename) {
+		read(size, filename + ".png", -1);
+	}
+
+
+	void frame_capture::start_recording(const string &path, format f) {
+		stop_recording();
+		if (f == raw_stream) {
+			m_stream.open(path, ios::binary);
+			if (!m_stream) {
+				cerr << "Error: Could not open " << path << " for writing" << endl;
+				throw runtime_error("Error: Could not open " + path + " for writing");
+			}
+		}
+		m_format = f;
+		m_path = path;
+		m_recorded = 0;
+		m_written = 0;
+		m_recording = true;
+	}
+
+
+	void frame_capture::stop_recording() {
+		if (!m_recording) return;
+		m_recording = false;
+		finish();
+		if (m_stream.is_open()) m_stream.close();
+		cout << "Recorded " << m_recorded << " frames to " << m_path << endl;
+	}
+
+
+	void frame_capture::frame(glm::ivec2 size) {
+		// hand over, oldest first, the readbacks that have already arrived
+		for (size_t k = 0; k < m_ring.size(); k++) {
+			slot &s = m_ring[(m_next + k) % m_ring.size()];
+			if (!s.fence) continue;
+			GLenum state = glClientWaitSync(s.fence, 0, 0);
+			if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED) break;
+			collect(s);
+		}
+
+		if (!m_recording) return;
+		if (m_format == png_sequence) {
+			char number[16];
+			snprintf(number, sizeof(number), "_%06lld", (long long)m_recorded);
+			read(size, m_path + number + ".png", m_recorded);
+		}
+		else {
+			read(size, "", m_recorded);
+		}
+		m_recorded++;
+	}
+
+
+	void frame_capture::finish() {
+		for (size_t k = 0; k < m_ring.size(); k++) {
+			slot &s = m_ring[(m_next + k) % m_ring.size()];
+			if (s.fence) collect(s);
+		}
+		unique_lock<mutex> lock(m_mutex);
+		m_done.wait(lock, [&] { return m_busy == 0; });
+		lock.unlock();
+
+		for (slot &s : m_ring) {
+			gpu_release(gpu_kind::buffer, s.pbo);
+			if (s.pbo) glDeleteBuffers(1, &s.pbo);
+			s.pbo = 0;
+			s.capacity = 0;
+		}
+	}
+}
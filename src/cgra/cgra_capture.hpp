@@ -0,0 +1,101 @@
+#pragma once
+
+// std
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// glm
+#include <glm/glm.hpp>
+
+// project
+#include <opengl.hpp>
+
+
+namespace cgra {
+
+	// Reads frames back from the framebuffer without stalling the render thread.
+	// glReadPixels goes into one of a ring of pixel buffer objects and returns at
+	// once; a few frames later, when its fence has signalled, the buffer is mapped
+	// and copied out, and the copy is encoded on a pool of background threads.
+	// Screenshots are written as PNG. A recording captures every frame, either as
+	// a numbered PNG sequence or appended to one raw RGBA stream (top row first),
+	// which can be converted with
+	//
+	//   ffmpeg -f rawvideo -pix_fmt rgba -s <w>x<h> -r <fps> -i <file> out.mp4
+	//
+	// All methods except the counters must be called on the thread owning the GL
+	// context, and finish() before the context is destroyed.
+	class frame_capture {
+	public:
+		enum format { png_sequence, raw_stream };
+
+	private:
+		// a readback in flight
+		struct slot {
+			GLuint pbo = 0;
+			size_t capacity = 0;
+			GLsync fence = nullptr;
+			glm::ivec2 size{ 0 };
+			std::string filename; // png to write, empty for a raw stream frame
+			int64_t frame = -1; // index in the raw stream
+		};
+
+		std::vector<slot> m_ring;
+		size_t m_next = 0; // slot of the next readback, the oldest one in flight
+
+		// background encoders
+		std::vector<std::thread> m_workers;
+		std::deque<std::function<void()>> m_jobs;
+		std::mutex m_mutex;
+		std::condition_variable m_wake; // a job was queued or the pool is stopping
+		std::condition_variable m_done; // a job finished
+		size_t m_busy = 0; // jobs queued or running
+		size_t m_max_jobs;
+		bool m_stopping = false;
+
+		// recording
+		bool m_recording = false;
+		format m_format = png_sequence;
+		std::string m_path;
+		int64_t m_recorded = 0; // frames read back so far
+		std::ofstream m_stream;
+		int64_t m_written = 0; // raw frames appended so far, guarded by m_mutex
+
+		void read(glm::ivec2 size, const std::string &filename, int64_t frame);
+		void collect(slot &s);
+		void submit(std::function<void()> job);
+		void work();
+
+	public:
+		// ring_size readbacks can be in flight; threads = 0 uses all but one core
+		explicit frame_capture(int ring_size = 3, int threads = 0);
+		~frame_capture();
+
+		frame_capture(const frame_capture &) = delete;
+		frame_capture & operator=(const frame_capture &) = delete;
+
+		// queues a readback of the read framebuffer (size in pixels from the lower
+		// left), written to filename with ".png" appended once it arrives
+		void screenshot(glm::ivec2 size, const std::string &filename);
+
+		// path is a prefix for numbered PNGs ("<path>_000000.png") or the raw file
+		void start_recording(const std::string &path, format f);
+		void stop_recording();
+		bool recording() const { return m_recording; }
+		int64_t frames_recorded() const { return m_recorded; }
+
+		// call once per frame after drawing: hands finished readbacks to the
+		// encoders and, while recording, reads back this frame
+		void frame(glm::ivec2 size);
+
+		// waits for every readback and write in flight and releases the buffers
+		void finish();
+	};
+}
@@ -1,5 +1,6 @@
 
 // std
+#include <algorithm>
 #include <vector>
 
 //glm
@@ -9,6 +10,7 @@
 
 // project
 #include "cgra_geometry.hpp"
+#include "cgra_resources.hpp"
 #include "cgra_shader.hpp"
 #include <opengl.hpp>
 
@@ -21,13 +23,41 @@ namespace cgra {
 			glm::vec2 uv{ 0 };
 		};
 
-		GLuint compileDrawVAO(const float *vertices, int vcount, const unsigned int *indices, int icount) {
-			GLuint vao, vbo, ibo;
-			glGenVertexArrays(1, &vao);
-			glGenBuffers(1, &vbo);
-			glGenBuffers(1, &ibo);
-			glBindVertexArray(vao);
-			glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		// per-instance data of a queued primitive, read by the instanced shader
+		struct draw_instance {
+			glm::mat4 model;
+			glm::vec4 color;
+		};
+
+		// one of the built-in meshes, with its instanced draw state and queue
+		struct draw_primitive {
+			GLuint vao = 0;
+			GLuint vbo = 0;
+			GLuint ibo = 0;
+			int count = 0;
+			GLuint instanceVAO = 0; // shares vbo and ibo, adds the instance attributes
+			GLuint instanceVBO = 0;
+			size_t instanceCapacity = 0; // in instances
+			std::vector<draw_instance> queue;
+		};
+
+		// built on first use, released by releaseGeometry()
+		draw_primitive sphere_primitive, cylinder_primitive, cone_primitive;
+		shader_program instance_shader, axis_shader, grid_shader;
+		shader_uniform grid_model("uModelMatrix");
+		GLuint dummy_vao = 0;
+
+		void compileDrawVAO(draw_primitive &m, const float *vertices, int vcount, const unsigned int *indices, int icount) {
+			glGenVertexArrays(1, &m.vao);
+			glGenBuffers(1, &m.vbo);
+			glGenBuffers(1, &m.ibo);
+			CGRA_GPU_TRACK(gpu_kind::vertex_array, m.vao, "cgra", "primitive");
+			CGRA_GPU_TRACK(gpu_kind::buffer, m.vbo, "cgra", "primitive vertices");
+			CGRA_GPU_TRACK(gpu_kind::buffer, m.ibo, "cgra", "primitive indices");
+			gpu_resize(gpu_kind::buffer, m.vbo, vcount * sizeof(float));
+			gpu_resize(gpu_kind::buffer, m.ibo, icount * sizeof(unsigned int));
+			glBindVertexArray(m.vao);
+			glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
 			glBufferData(GL_ARRAY_BUFFER, vcount * sizeof(float), vertices, GL_STATIC_DRAW);
 			glEnableVertexAttribArray(0);
 			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(draw_mesh_vertex), (void *)(offsetof(draw_mesh_vertex, pos)));
@@ -35,15 +65,55 @@ namespace cgra {
 			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(draw_mesh_vertex), (void *)(offsetof(draw_mesh_vertex, norm)));
 			glEnableVertexAttribArray(2);
 			glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(draw_mesh_vertex), (void *)(offsetof(draw_mesh_vertex, uv)));
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
 			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * icount, indices, GL_STATIC_DRAW);
 			glBindVertexArray(0);
-			return vao;
+			m.count = icount;
+		}
+
+		// builds the VAO used for instanced draws of m: the mesh attributes plus
+		// the instance transform (locations 3 to 6) and color (location 7)
+		void compileInstanceVAO(draw_primitive &m) {
+			glGenVertexArrays(1, &m.instanceVAO);
+			glGenBuffers(1, &m.instanceVBO);
+			CGRA_GPU_TRACK(gpu_kind::vertex_array, m.instanceVAO, "cgra", "primitive instances");
+			CGRA_GPU_TRACK(gpu_kind::buffer, m.instanceVBO, "cgra", "primitive instances");
+			glBindVertexArray(m.instanceVAO);
+			glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(draw_mesh_vertex), (void *)(offsetof(draw_mesh_vertex, pos)));
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(draw_mesh_vertex), (void *)(offsetof(draw_mesh_vertex, norm)));
+			glEnableVertexAttribArray(2);
+			glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(draw_mesh_vertex), (void *)(offsetof(draw_mesh_vertex, uv)));
+			glBindBuffer(GL_ARRAY_BUFFER, m.instanceVBO);
+			for (int c = 0; c < 4; c++) {
+				glEnableVertexAttribArray(3 + c);
+				glVertexAttribPointer(3 + c, 4, GL_FLOAT, GL_FALSE, sizeof(draw_instance), (void *)(offsetof(draw_instance, model) + c * sizeof(glm::vec4)));
+				glVertexAttribDivisor(3 + c, 1);
+			}
+			glEnableVertexAttribArray(7);
+			glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(draw_instance), (void *)(offsetof(draw_instance, color)));
+			glVertexAttribDivisor(7, 1);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+			glBindVertexArray(0);
+		}
+
+		void destroyPrimitive(draw_primitive &m) {
+			for (GLuint *vao : { &m.vao, &m.instanceVAO }) {
+				gpu_release(gpu_kind::vertex_array, *vao);
+				glDeleteVertexArrays(1, vao);
+			}
+			for (GLuint *buffer : { &m.vbo, &m.ibo, &m.instanceVBO }) {
+				gpu_release(gpu_kind::buffer, *buffer);
+				glDeleteBuffers(1, buffer);
+			}
+			m = draw_primitive();
 		}
 	}
 
 
-	void drawSphere() {
+	static draw_primitive & sphereMesh() {
 		const float vert[] = {
 			0, 0, 1, 0, 0, 1, 0, 0,
 			0, 0, 1, 0, 0, 1, 0.05, 0,
@@ -401,20 +471,15 @@ namespace cgra {
 			229, 207, 229, 208, 208, 229, 230, 208, 230, 209
 		};
 
-		static GLuint m = 0;
-		static int c = 0;
-
-		if (m == 0) {
-			int v = sizeof(vert) / sizeof(vert[0]);
-			c = sizeof(idx) / sizeof(idx[0]);
-			m = compileDrawVAO(vert, v, idx, c);
+		draw_primitive &m = sphere_primitive;
+		if (m.vao == 0) {
+			compileDrawVAO(m, vert, sizeof(vert) / sizeof(vert[0]), idx, sizeof(idx) / sizeof(idx[0]));
 		}
-		glBindVertexArray(m);
-		glDrawElements(GL_TRIANGLES, c, GL_UNSIGNED_INT, 0);
+		return m;
 	}
 
 
-	void drawCylinder() {
+	static draw_primitive & cylinderMesh() {
 
 		const float vert[] = {
 			1, 0, 0, 1, 0, 0, 0, 0,
@@ -533,20 +598,15 @@ namespace cgra {
 			64, 84, 65, 64, 65, 66
 		};
 
-		static GLuint m = 0;
-		static int c = 0;
-
-		if (m == 0) {
-			int v = sizeof(vert) / sizeof(vert[0]);
-			c = sizeof(idx) / sizeof(idx[0]);
-			m = compileDrawVAO(vert, v, idx, c);
+		draw_primitive &m = cylinder_primitive;
+		if (m.vao == 0) {
+			compileDrawVAO(m, vert, sizeof(vert) / sizeof(vert[0]), idx, sizeof(idx) / sizeof(idx[0]));
 		}
-		glBindVertexArray(m);
-		glDrawElements(GL_TRIANGLES, c, GL_UNSIGNED_INT, 0);
+		return m;
 	}
 
 
-	void drawCone() {
+	static draw_primitive & coneMesh() {
 
 		const float vert[] = {
 			1, 0, 0, 0.330748, 0, 0.943719, 0, 0,
@@ -631,26 +691,125 @@ namespace cgra {
 			42, 44, 43
 		};
 
-		static GLuint m = 0;
-		static int c = 0;
+		draw_primitive &m = cone_primitive;
+		if (m.vao == 0) {
+			compileDrawVAO(m, vert, sizeof(vert) / sizeof(vert[0]), idx, sizeof(idx) / sizeof(idx[0]));
+		}
+		return m;
+	}
+
+
+	void drawSphere() {
+		draw_primitive &m = sphereMesh();
+		glBindVertexArray(m.vao);
+		glDrawElements(GL_TRIANGLES, m.count, GL_UNSIGNED_INT, 0);
+	}
+
+
+	void drawCylinder() {
+		draw_primitive &m = cylinderMesh();
+		glBindVertexArray(m.vao);
+		glDrawElements(GL_TRIANGLES, m.count, GL_UNSIGNED_INT, 0);
+	}
+
+
+	void drawCone() {
+		draw_primitive &m = coneMesh();
+		glBindVertexArray(m.vao);
+		glDrawElements(GL_TRIANGLES, m.count, GL_UNSIGNED_INT, 0);
+	}
+
+
+	void queueSphere(const glm::mat4 &model, const glm::vec4 &color) {
+		sphereMesh().queue.push_back({ model, color });
+	}
+
+
+	void queueCylinder(const glm::mat4 &model, const glm::vec4 &color) {
+		cylinderMesh().queue.push_back({ model, color });
+	}
+
+
+	void queueCone(const glm::mat4 &model, const glm::vec4 &color) {
+		coneMesh().queue.push_back({ model, color });
+	}
+
+
+	void flushPrimitives() {
+
+		const char* instance_shader_source = R"(
+	#version 330 core
+	layout(std140) uniform FrameData {
+		mat4 uProjectionMatrix;
+		mat4 uViewMatrix;
+		vec4 uLightDirection;
+		vec4 uLightColor;
+	};
+#ifdef _VERTEX_
+	layout(location = 0) in vec3 aPosition;
+	layout(location = 1) in vec3 aNormal;
+	layout(location = 3) in mat4 aModelMatrix;
+	layout(location = 7) in vec4 aColor;
+	out vec3 v_position;
+	out vec3 v_normal;
+	flat out vec4 v_color;
+	void main() {
+		mat4 modelView = uViewMatrix * aModelMatrix;
+		v_position = (modelView * vec4(aPosition, 1)).xyz;
+		v_normal = normalize((modelView * vec4(aNormal, 0)).xyz);
+		v_color = aColor;
+		gl_Position = uProjectionMatrix * vec4(v_position, 1);
+	}
+#endif
+#ifdef _FRAGMENT_
+	in vec3 v_position;
+	in vec3 v_normal;
+	flat in vec4 v_color;
+	out vec4 f_color;
+	void main() {
+		float light = abs(dot(normalize(v_normal), normalize(-v_position)));
+		f_color = vec4(mix(v_color.rgb / 4, v_color.rgb, light), v_color.a);
+	}
+#endif)";
+		if (!instance_shader) {
+			shader_builder prog;
+			prog.set_owner("cgra");
+			prog.set_shader_source(GL_VERTEX_SHADER, instance_shader_source);
+			prog.set_shader_source(GL_FRAGMENT_SHADER, instance_shader_source);
+			instance_shader = prog.build();
+		}
 
-		if (m == 0) {
-			int v = sizeof(vert) / sizeof(vert[0]);
-			c = sizeof(idx) / sizeof(idx[0]);
-			m = compileDrawVAO(vert, v, idx, c);
+		instance_shader.use();
+		for (draw_primitive *m : { &sphereMesh(), &cylinderMesh(), &coneMesh() }) {
+			if (m->queue.empty()) continue;
+			if (!m->instanceVAO) compileInstanceVAO(*m);
+
+			// grow the buffer geometrically, otherwise orphan it so the upload does not wait on the last draw
+			glBindBuffer(GL_ARRAY_BUFFER, m->instanceVBO);
+			if (m->queue.size() > m->instanceCapacity) m->instanceCapacity = std::max(m->queue.size(), 2 * m->instanceCapacity);
+			glBufferData(GL_ARRAY_BUFFER, m->instanceCapacity * sizeof(draw_instance), nullptr, GL_STREAM_DRAW);
+			gpu_resize(gpu_kind::buffer, m->instanceVBO, m->instanceCapacity * sizeof(draw_instance));
+			glBufferSubData(GL_ARRAY_BUFFER, 0, m->queue.size() * sizeof(draw_instance), m->queue.data());
+
+			glBindVertexArray(m->instanceVAO);
+			glDrawElementsInstanced(GL_TRIANGLES, m->count, GL_UNSIGNED_INT, 0, GLsizei(m->queue.size()));
+			m->queue.clear();
 		}
-		glBindVertexArray(m);
-		glDrawElements(GL_TRIANGLES, c, GL_UNSIGNED_INT, 0);
+		glBindVertexArray(0);
 	}
 
 
 
-	void drawAxis(const glm::mat4 &view, const glm::mat4 &proj) {
+	void drawAxis() {
 
 		const char* axis_shader_source = R"(
 	#version 330 core
-	uniform mat4 uProjectionMatrix;
-	uniform mat4 uModelViewMatrix;
+	layout(std140) uniform FrameData {
+		mat4 uProjectionMatrix;
+		mat4 uViewMatrix;
+		vec4 uLightDirection;
+		vec4 uLightColor;
+	};
 #ifdef _VERTEX_
 	flat out int v_instanceID;
 	void main() {
@@ -672,10 +831,10 @@ namespace cgra {
 	);
 	void main() {
 		v_color = abs(dir[v_instanceID[0]]);
-		gl_Position = uProjectionMatrix * uModelViewMatrix * vec4(0.0, 0.0, 0.0, 1.0);
+		gl_Position = uProjectionMatrix * uViewMatrix * vec4(0.0, 0.0, 0.0, 1.0);
 		EmitVertex();
 		v_color = abs(dir[v_instanceID[0]]);
-		gl_Position = uProjectionMatrix * uModelViewMatrix * vec4(normalize(dir[v_instanceID[0]]) * 1000, 1.0);
+		gl_Position = uProjectionMatrix * uViewMatrix * vec4(normalize(dir[v_instanceID[0]]) * 1000, 1.0);
 		EmitVertex();
 		EndPrimitive();
 	}
@@ -688,28 +847,31 @@ namespace cgra {
 		f_color = v_color;
 	}
 #endif)";
-		static GLuint axis_shader = 0;
 		if (!axis_shader) {
 			shader_builder prog;
+			prog.set_owner("cgra");
 			prog.set_shader_source(GL_VERTEX_SHADER, axis_shader_source);
 			prog.set_shader_source(GL_GEOMETRY_SHADER, axis_shader_source);
 			prog.set_shader_source(GL_FRAGMENT_SHADER, axis_shader_source);
 			axis_shader = prog.build();
 		}
 
-		glUseProgram(axis_shader);
-		glUniformMatrix4fv(glGetUniformLocation(axis_shader, "uProjectionMatrix"), 1, false, value_ptr(proj));
-		glUniformMatrix4fv(glGetUniformLocation(axis_shader, "uModelViewMatrix"), 1, false, value_ptr(view));
+		axis_shader.use();
 		draw_dummy(6);
 	}
 
 
-	void drawGrid(const glm::mat4 &view, const glm::mat4 &proj) {
+	void drawGrid() {
 
 		const char* grid_shader_source = R"(
 	#version 330 core
-	uniform mat4 uProjectionMatrix;
-	uniform mat4 uModelViewMatrix;
+	layout(std140) uniform FrameData {
+		mat4 uProjectionMatrix;
+		mat4 uViewMatrix;
+		vec4 uLightDirection;
+		vec4 uLightColor;
+	};
+	uniform mat4 uModelMatrix;
 #ifdef _VERTEX_
 	flat out int v_instanceID;
 	void main() {
@@ -721,9 +883,9 @@ namespace cgra {
 	layout(line_strip, max_vertices = 2) out;
 	flat in int v_instanceID[];
 	void main() {
-		gl_Position = uProjectionMatrix * uModelViewMatrix * vec4(v_instanceID[0] - 10, 0, -10, 1);
+		gl_Position = uProjectionMatrix * uViewMatrix * uModelMatrix * vec4(v_instanceID[0] - 10, 0, -10, 1);
 		EmitVertex();
-		gl_Position = uProjectionMatrix * uModelViewMatrix * vec4(v_instanceID[0] - 10, 0, 10, 1);
+		gl_Position = uProjectionMatrix * uViewMatrix * uModelMatrix * vec4(v_instanceID[0] - 10, 0, 10, 1);
 		EmitVertex();
 		EndPrimitive();
 	}
@@ -734,9 +896,9 @@ namespace cgra {
 		f_color = vec3(0.5, 0.5, 0.5);
 	}
 #endif)";
-		static GLuint grid_shader = 0;
 		if (!grid_shader) {
 			shader_builder prog;
+			prog.set_owner("cgra");
 			prog.set_shader_source(GL_VERTEX_SHADER, grid_shader_source);
 			prog.set_shader_source(GL_GEOMETRY_SHADER, grid_shader_source);
 			prog.set_shader_source(GL_FRAGMENT_SHADER, grid_shader_source);
@@ -745,11 +907,30 @@ namespace cgra {
 
 		const glm::mat4 rot = glm::rotate(glm::mat4(1), glm::pi<float>() / 2.f, glm::vec3(0, 1, 0));
 
-		glUseProgram(grid_shader);
-		glUniformMatrix4fv(glGetUniformLocation(grid_shader, "uProjectionMatrix"), 1, false, value_ptr(proj));
-		glUniformMatrix4fv(glGetUniformLocation(grid_shader, "uModelViewMatrix"), 1, false, value_ptr(view));
+		grid_shader.use();
+		grid_shader.set_uniform(grid_model, glm::mat4(1));
 		draw_dummy(21);
-		glUniformMatrix4fv(glGetUniformLocation(grid_shader, "uModelViewMatrix"), 1, false, value_ptr(view * rot));
+		grid_shader.set_uniform(grid_model, rot);
 		draw_dummy(21);
 	}
-}
\ No newline at end of file
+
+
+	void draw_dummy(unsigned instances) {
+		if (dummy_vao == 0) {
+			glGenVertexArrays(1, &dummy_vao);
+			CGRA_GPU_TRACK(gpu_kind::vertex_array, dummy_vao, "cgra", "empty");
+		}
+		glBindVertexArray(dummy_vao);
+		glDrawArraysInstanced(GL_POINTS, 0, 1, instances);
+		glBindVertexArray(0);
+	}
+
+
+	void releaseGeometry() {
+		for (draw_primitive *m : { &sphere_primitive, &cylinder_primitive, &cone_primitive }) destroyPrimitive(*m);
+		for (shader_program *s : { &instance_shader, &axis_shader, &grid_shader }) s->destroy();
+		gpu_release(gpu_kind::vertex_array, dummy_vao);
+		glDeleteVertexArrays(1, &dummy_vao);
+		dummy_vao = 0;
+	}
+}
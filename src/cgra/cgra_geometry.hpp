@@ -1,6 +1,9 @@
 
 #pragma once
 
+// glm
+#include <glm/glm.hpp>
+
 namespace cgra {
 	
 	// creates a mesh for a unit sphere (radius of 1)
@@ -15,9 +18,25 @@ namespace cgra {
 	// immediately draws the sphere mesh, assuming the shader is set up
 	void drawCone();
 
+	// queues an instance of the unit sphere, cylinder or cone with its own model transform and color
+	// nothing is drawn until flushPrimitives(), so these can be called thousands of times per frame
+	void queueSphere(const glm::mat4 &model, const glm::vec4 &color);
+	void queueCylinder(const glm::mat4 &model, const glm::vec4 &color);
+	void queueCone(const glm::mat4 &model, const glm::vec4 &color);
+
+	// draws everything queued since the last flush with one instanced draw per primitive type,
+	// using a built-in shader and the camera in FrameData, then empties the queues
+	void flushPrimitives();
+
 	// sets up a shader and draws an axis straight to the current framebuffer
-	void drawAxis(const glm::mat4 &view, const glm::mat4 &proj);
+	// with the camera in FrameData (see upload_frame_data)
+	void drawAxis();
 
 	// sets up a shader and draws a grid straight to the current framebuffer
-	void drawGrid(const glm::mat4 &view, const glm::mat4 &proj);
+	// with the camera in FrameData (see upload_frame_data)
+	void drawGrid();
+
+	// deletes the meshes, buffers and shaders the functions above create on first use
+	// (they are made again if drawn afterwards), call before the context is destroyed
+	void releaseGeometry();
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 // project
 #include "cgra_gui.hpp"
+#include "cgra_resources.hpp"
 
 
 using namespace std;
@@ -41,10 +42,12 @@ namespace cgra {
 			GLint last_texture;
 			glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture);
 			glGenTextures(1, &g_fontTexture);
+			CGRA_GPU_TRACK(gpu_kind::texture, g_fontTexture, "gui", "font atlas");
 			glBindTexture(GL_TEXTURE_2D, g_fontTexture);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+			gpu_resize(gpu_kind::texture, g_fontTexture, size_t(width) * height * 4);
 
 			// store our identifier
 			io.Fonts->TexID = (void *)(intptr_t)g_fontTexture;
@@ -85,6 +88,7 @@ namespace cgra {
 				"}\n";
 
 			g_shaderHandle = glCreateProgram();
+			CGRA_GPU_TRACK(gpu_kind::program, g_shaderHandle, "gui");
 			g_vertHandle = glCreateShader(GL_VERTEX_SHADER);
 			g_fragHandle = glCreateShader(GL_FRAGMENT_SHADER);
 			glShaderSource(g_vertHandle, 1, &vertex_shader, 0);
@@ -103,8 +107,11 @@ namespace cgra {
 
 			glGenBuffers(1, &g_vboHandle);
 			glGenBuffers(1, &g_elementsHandle);
+			CGRA_GPU_TRACK(gpu_kind::buffer, g_vboHandle, "gui", "vertices");
+			CGRA_GPU_TRACK(gpu_kind::buffer, g_elementsHandle, "gui", "indices");
 
 			glGenVertexArrays(1, &g_vaoHandle);
+			CGRA_GPU_TRACK(gpu_kind::vertex_array, g_vaoHandle, "gui");
 			glBindVertexArray(g_vaoHandle);
 			glBindBuffer(GL_ARRAY_BUFFER, g_vboHandle);
 			glEnableVertexAttribArray(g_attribLocationPosition);
@@ -129,6 +136,12 @@ namespace cgra {
 
 
 		void invalidateDeviceObjects() {
+			gpu_release(gpu_kind::vertex_array, g_vaoHandle);
+			gpu_release(gpu_kind::buffer, g_vboHandle);
+			gpu_release(gpu_kind::buffer, g_elementsHandle);
+			gpu_release(gpu_kind::program, g_shaderHandle);
+			gpu_release(gpu_kind::texture, g_fontTexture);
+
 			if (g_vaoHandle) glDeleteVertexArrays(1, &g_vaoHandle);
 			if (g_vboHandle) glDeleteBuffers(1, &g_vboHandle);
 			if (g_elementsHandle) glDeleteBuffers(1, &g_elementsHandle);
@@ -214,9 +227,11 @@ namespace cgra {
 
 				glBindBuffer(GL_ARRAY_BUFFER, g_vboHandle);
 				glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)cmd_list->VtxBuffer.Size * sizeof(ImDrawVert), (const GLvoid*)cmd_list->VtxBuffer.Data, GL_STREAM_DRAW);
+				gpu_resize(gpu_kind::buffer, g_vboHandle, cmd_list->VtxBuffer.Size * sizeof(ImDrawVert));
 
 				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_elementsHandle);
 				glBufferData(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)cmd_list->IdxBuffer.Size * sizeof(ImDrawIdx), (const GLvoid*)cmd_list->IdxBuffer.Data, GL_STREAM_DRAW);
+				gpu_resize(gpu_kind::buffer, g_elementsHandle, cmd_list->IdxBuffer.Size * sizeof(ImDrawIdx));
 
 				for (int cmd_i = 0; cmd_i < cmd_list->CmdBuffer.Size; cmd_i++) {
 					const ImDrawCmd* pcmd = &cmd_list->CmdBuffer[cmd_i];
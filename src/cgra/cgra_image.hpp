@@ -16,6 +16,7 @@
 
 // project
 #include <opengl.hpp>
+#include "cgra_resources.hpp"
 
 
 namespace cgra {
@@ -43,11 +44,14 @@ namespace cgra {
 			stbi_image_free(raw_stb_data);
 		}
 
-		// generates and returns a texture object
-		GLuint uploadTexture(GLenum format = GL_RGBA8, GLuint tex = 0) const {
+		// generates and returns a texture object, tracked under owner (see cgra_resources.hpp)
+		GLuint uploadTexture(GLenum format = GL_RGBA8, GLuint tex = 0, const std::string &owner = "image") const {
 			assert(size.x * size.y * 4 == data.size()); // check we have consistent size and data
 
-			if (!tex) glGenTextures(1, &tex);
+			if (!tex) {
+				glGenTextures(1, &tex);
+				CGRA_GPU_TRACK(gpu_kind::texture, tex, owner);
+			}
 			glActiveTexture(GL_TEXTURE0);
 			glBindTexture(GL_TEXTURE_2D, tex);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -59,6 +63,7 @@ namespace cgra {
 				GL_RGBA, GL_UNSIGNED_BYTE, data.data()
 			);
 			glGenerateMipmap(GL_TEXTURE_2D);
+			gpu_resize(gpu_kind::texture, tex, data.size() * 4 / 3); // assuming 4 bytes a texel, plus the mipmaps
 			return tex;
 		}
 
@@ -4,6 +4,7 @@
 
 // project
 #include "cgra_mesh.hpp"
+#include "cgra_resources.hpp"
 
 
 
@@ -21,18 +22,64 @@ namespace cgra {
 
 	void gl_mesh::destroy() {
 		// delete the data buffers
+		gpu_release(gpu_kind::vertex_array, vao);
+		gpu_release(gpu_kind::buffer, vbo);
+		gpu_release(gpu_kind::buffer, ibo);
 		glDeleteVertexArrays(1, &vao);
 		glDeleteBuffers(1, &vbo);
 		glDeleteBuffers(1, &ibo);
+		vao = vbo = ibo = 0;
 	}
 
 
-	gl_mesh mesh_builder::build() const {
+	frustum::frustum(const mat4 &clip) {
+		// Gribb and Hartmann: each plane is the last row of the clip matrix plus or minus another row
+		mat4 t = transpose(clip);
+		planes[0] = t[3] + t[0]; // left
+		planes[1] = t[3] - t[0]; // right
+		planes[2] = t[3] + t[1]; // bottom
+		planes[3] = t[3] - t[1]; // top
+		planes[4] = t[3] + t[2]; // near
+		planes[5] = t[3] - t[2]; // far
+	}
+
+
+	frustum frustum::transformed(const mat4 &model) const {
+		frustum f;
+		for (int i = 0; i < 6; i++) f.planes[i] = planes[i] * model;
+		return f;
+	}
+
+
+	bool frustum::intersects(const vec3 &lo, const vec3 &hi) const {
+		for (const vec4 &p : planes) {
+			// the corner furthest along the plane normal
+			vec3 v(p.x >= 0 ? hi.x : lo.x, p.y >= 0 ? hi.y : lo.y, p.z >= 0 ? hi.z : lo.z);
+			if (dot(vec3(p), v) + p.w < 0) return false;
+		}
+		return true;
+	}
+
+
+	bool frustum::within(const vec3 &lo, const vec3 &hi, float distance) const {
+		// the near plane scaled to measure distances, and the corner nearest to it
+		vec4 p = planes[4] / length(vec3(planes[4]));
+		vec3 v(p.x >= 0 ? lo.x : hi.x, p.y >= 0 ? lo.y : hi.y, p.z >= 0 ? lo.z : hi.z);
+		return dot(vec3(p), v) + p.w <= distance;
+	}
+
+
+	gl_mesh mesh_builder::build(const std::string &owner) const {
 
 		gl_mesh m;
 		glGenVertexArrays(1, &m.vao); // VAO stores information about how the buffers are set up
 		glGenBuffers(1, &m.vbo); // VBO stores the vertex data
 		glGenBuffers(1, &m.ibo); // IBO stores the indices that make up primitives
+		CGRA_GPU_TRACK(gpu_kind::vertex_array, m.vao, owner, "mesh");
+		CGRA_GPU_TRACK(gpu_kind::buffer, m.vbo, owner, "mesh vertices");
+		CGRA_GPU_TRACK(gpu_kind::buffer, m.ibo, owner, "mesh indices");
+		gpu_resize(gpu_kind::buffer, m.vbo, vertices.size() * sizeof(mesh_vertex));
+		gpu_resize(gpu_kind::buffer, m.ibo, indices.size() * sizeof(unsigned int));
 
 
 		// VAO
@@ -71,6 +118,15 @@ namespace cgra {
 		m.index_count = indices.size();
 		m.mode = mode;
 
+		// bounds for culling
+		if (!vertices.empty()) {
+			m.bounds_min = m.bounds_max = vertices[0].pos;
+			for (const mesh_vertex &v : vertices) {
+				m.bounds_min = min(m.bounds_min, v.pos);
+				m.bounds_max = max(m.bounds_max, v.pos);
+			}
+		}
+
 		// clean up by binding VAO 0 (good practice)
 		glBindVertexArray(0);
 
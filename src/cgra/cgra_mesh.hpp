@@ -3,6 +3,7 @@
 
 // std
 #include <iostream>
+#include <string>
 #include <vector>
 
 // glm
@@ -26,15 +27,36 @@ namespace cgra {
 		GLuint ibo = 0;
 		GLenum mode = 0; // mode to draw in, eg: GL_TRIANGLES
 		int index_count = 0; // how many indicies to draw (no primitives)
+		glm::vec3 bounds_min{0}; // axis aligned bounds of the vertices in model space
+		glm::vec3 bounds_max{0};
 
 		// calls the draw function on mesh data
 		void draw();
 
-		// deletes the gl buffers (cleans up all the data)
+		// deletes the gl buffers (cleans up all the data) and zeroes their ids
 		void destroy();
 	};
 
 
+	// The six planes of a view volume, extracted from a clip matrix (proj * view, or
+	// proj * view * model to test boxes given in model space). Plane normals point inwards.
+	struct frustum {
+		glm::vec4 planes[6];
+
+		frustum() { }
+		explicit frustum(const glm::mat4 &clip);
+
+		// the same volume in the space model maps from, same as frustum(clip * model)
+		frustum transformed(const glm::mat4 &model) const;
+
+		// false only if the box is entirely outside one of the planes (conservative)
+		bool intersects(const glm::vec3 &lo, const glm::vec3 &hi) const;
+
+		// false if all of the box is more than distance beyond the near plane
+		bool within(const glm::vec3 &lo, const glm::vec3 &hi, float distance) const;
+	};
+
+
 	struct mesh_vertex {
 		glm::vec3 pos{0};
 		glm::vec3 norm{0};
@@ -73,7 +95,8 @@ namespace cgra {
 			indices.insert(indices.end(), inds);
 		}
 
-		gl_mesh build() const;
+		// uploads the mesh, its buffers are tracked under owner (see cgra_resources.hpp)
+		gl_mesh build(const std::string &owner = "mesh") const;
 
 		void print() const {
 			std::cout << "pos" << std::endl;
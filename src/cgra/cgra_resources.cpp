@@ -0,0 +1,160 @@
+// std
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+// project
+#include "cgra_resources.hpp"
+
+
+using namespace std;
+
+namespace cgra {
+
+	namespace {
+		unordered_map<uint64_t, gpu_resource> g_resources;
+		size_t g_bytes = 0;
+		size_t g_budget = 0;
+		bool g_overBudget = false;
+
+		uint64_t key(gpu_kind kind, GLuint name) {
+			return (uint64_t(kind) << 32) | name;
+		}
+
+		// creation site without the directories
+		const char * basename(const char *file) {
+			const char *b = file;
+			for (const char *c = file; *c; c++) {
+				if (*c == '/' || *c == '\\') b = c + 1;
+			}
+			return b;
+		}
+
+		void checkBudget() {
+			if (!g_budget) return;
+			if (g_bytes <= g_budget) {
+				g_overBudget = false;
+				return;
+			}
+			if (g_overBudget) return;
+			g_overBudget = true;
+			ostringstream msg;
+			msg << fixed << setprecision(1) << "Warning: GPU memory " << g_bytes / 1048576.0 << " MB is over the budget of "
+				<< g_budget / 1048576.0 << " MB (";
+			vector<gpu_usage> owners = gpu_usage_by_owner();
+			for (size_t i = 0; i < owners.size() && i < 3; i++) {
+				msg << (i ? ", " : "") << owners[i].owner << " " << owners[i].bytes / 1048576.0 << " MB";
+			}
+			msg << ")";
+			cerr << msg.str() << endl;
+		}
+	}
+
+
+	const char * gpu_kind_name(gpu_kind kind) {
+		switch (kind) {
+		case gpu_kind::buffer: return "buffer";
+		case gpu_kind::vertex_array: return "vertex array";
+		case gpu_kind::texture: return "texture";
+		case gpu_kind::renderbuffer: return "renderbuffer";
+		case gpu_kind::framebuffer: return "framebuffer";
+		case gpu_kind::program: return "program";
+		}
+		return "object";
+	}
+
+
+	void gpu_track(const char *file, int line, gpu_kind kind, GLuint name, const string &owner, const string &label) {
+		if (!name) return;
+		gpu_resource &r = g_resources[key(kind, name)];
+		g_bytes -= r.bytes; // a name that was deleted behind the registry's back
+		r.kind = kind;
+		r.name = name;
+		r.bytes = 0;
+		r.owner = owner;
+		r.label = label;
+		r.file = file;
+		r.line = line;
+	}
+
+
+	void gpu_resize(gpu_kind kind, GLuint name, size_t bytes) {
+		auto it = g_resources.find(key(kind, name));
+		if (it == g_resources.end() || it->second.bytes == bytes) return;
+		g_bytes = g_bytes - it->second.bytes + bytes;
+		it->second.bytes = bytes;
+		checkBudget();
+	}
+
+
+	void gpu_release(gpu_kind kind, GLuint name) {
+		auto it = g_resources.find(key(kind, name));
+		if (it == g_resources.end()) return;
+		g_bytes -= it->second.bytes;
+		g_resources.erase(it);
+		checkBudget();
+	}
+
+
+	size_t gpu_bytes() {
+		return g_bytes;
+	}
+
+
+	vector<gpu_usage> gpu_usage_by_owner() {
+		map<string, gpu_usage> owners;
+		for (auto &r : g_resources) {
+			gpu_usage &u = owners[r.second.owner];
+			u.owner = r.second.owner;
+			u.bytes += r.second.bytes;
+			u.objects++;
+		}
+		vector<gpu_usage> usage;
+		for (auto &o : owners) usage.push_back(o.second);
+		stable_sort(usage.begin(), usage.end(), [](const gpu_usage &a, const gpu_usage &b) { return a.bytes > b.bytes; });
+		return usage;
+	}
+
+
+	void gpu_set_budget(size_t bytes) {
+		g_budget = bytes;
+		g_overBudget = false;
+		checkBudget();
+	}
+
+
+	size_t gpu_budget() {
+		return g_budget;
+	}
+
+
+	bool gpu_over_budget() {
+		return g_budget && g_bytes > g_budget;
+	}
+
+
+	int gpu_report_leaks(ostream &out) {
+		if (g_resources.empty()) return 0;
+
+		// in creation order as far as names go, grouped by owner
+		vector<const gpu_resource *> leaked;
+		for (auto &r : g_resources) leaked.push_back(&r.second);
+		sort(leaked.begin(), leaked.end(), [](const gpu_resource *a, const gpu_resource *b) {
+			if (a->owner != b->owner) return a->owner < b->owner;
+			if (a->kind != b->kind) return a->kind < b->kind;
+			return a->name < b->name;
+		});
+
+		out << "Warning: " << leaked.size() << " GL objects (" << g_bytes << " bytes) were never released:" << endl;
+		for (const gpu_resource *r : leaked) {
+			out << "  " << r->owner << ": " << gpu_kind_name(r->kind) << " " << r->name;
+			if (!r->label.empty()) out << " (" << r->label << ")";
+			out << ", " << r->bytes << " bytes, created at " << basename(r->file) << ":" << r->line << endl;
+		}
+		return int(leaked.size());
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// project
+#include <opengl.hpp>
+
+
+namespace cgra {
+
+	enum class gpu_kind { buffer, vertex_array, texture, renderbuffer, framebuffer, program };
+
+	const char * gpu_kind_name(gpu_kind kind);
+
+	// A live GL object in the registry.
+	struct gpu_resource {
+		gpu_kind kind = gpu_kind::buffer;
+		GLuint name = 0;
+		size_t bytes = 0; // storage the driver was asked for, 0 if not known (VAOs, programs)
+		std::string owner; // subsystem that releases it, eg: "water"
+		std::string label; // what it holds, may be empty
+		const char *file = ""; // creation site
+		int line = 0;
+	};
+
+	// Memory and object count of one owner.
+	struct gpu_usage {
+		std::string owner;
+		size_t bytes = 0;
+		int objects = 0;
+	};
+
+	// Registry of the GL buffers, vertex arrays, textures, renderbuffers, framebuffers and
+	// programs the program creates. Every glGen*/glCreateProgram is followed by a track
+	// (use CGRA_GPU_TRACK so the creation site is recorded), every upload that allocates
+	// storage by gpu_resize, and every glDelete* by gpu_release. Whatever is still tracked
+	// when gpu_report_leaks() runs at shutdown was never released.
+	// All of these must be called on the thread owning the GL context.
+	void gpu_track(const char *file, int line, gpu_kind kind, GLuint name, const std::string &owner, const std::string &label = "");
+	void gpu_resize(gpu_kind kind, GLuint name, size_t bytes);
+	void gpu_release(gpu_kind kind, GLuint name);
+
+	// total bytes of the tracked objects, and the same split by owner (largest first)
+	size_t gpu_bytes();
+	std::vector<gpu_usage> gpu_usage_by_owner();
+
+	// a warning is printed when the total first grows past budget bytes (0 disables),
+	// and again after it has dropped back under
+	void gpu_set_budget(size_t bytes);
+	size_t gpu_budget();
+	bool gpu_over_budget();
+
+	// prints every object still tracked with its owner and creation site,
+	// returns how many there were
+	int gpu_report_leaks(std::ostream &out);
+}
+
+// CGRA_GPU_TRACK(kind, name, owner[, label]) tracks an object created on this line
+#define CGRA_GPU_TRACK(...) ::cgra::gpu_track(__FILE__, __LINE__, __VA_ARGS__)
@@ -1,15 +1,31 @@
 
 // std
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
 #include <vector>
 
+// glm
+#include <glm/gtc/type_ptr.hpp>
+
 // project
+#include "cgra_resources.hpp"
 #include "cgra_shader.hpp"
 #include <opengl.hpp>
 
+// platform
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
 
 // forward declaration
 class shader_error : public std::runtime_error {
@@ -62,6 +78,185 @@ void printProgramInfoLog(GLuint obj) {
 
 namespace cgra {
 
+	static_assert(sizeof(frame_data) == 2 * sizeof(glm::mat4) + 2 * sizeof(glm::vec4), "frame_data must match the std140 FrameData block");
+
+
+	namespace {
+		GLuint ubo = 0; // behind FrameData
+	}
+
+
+	void upload_frame_data(const frame_data &data) {
+		if (!ubo) {
+			glGenBuffers(1, &ubo);
+			CGRA_GPU_TRACK(gpu_kind::buffer, ubo, "cgra", "frame data");
+			glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+			glBufferData(GL_UNIFORM_BUFFER, sizeof(frame_data), nullptr, GL_DYNAMIC_DRAW);
+			gpu_resize(gpu_kind::buffer, ubo, sizeof(frame_data));
+			glBindBufferBase(GL_UNIFORM_BUFFER, frame_data_binding, ubo);
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame_data), &data);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+
+	void release_frame_data() {
+		gpu_release(gpu_kind::buffer, ubo);
+		glDeleteBuffers(1, &ubo);
+		ubo = 0;
+	}
+
+
+	namespace {
+		unsigned long long last_program_serial = 0;
+
+		void upload(GLint location, int v) { glUniform1i(location, v); }
+		void upload(GLint location, float v) { glUniform1f(location, v); }
+		void upload(GLint location, const glm::vec2 &v) { glUniform2fv(location, 1, glm::value_ptr(v)); }
+		void upload(GLint location, const glm::vec3 &v) { glUniform3fv(location, 1, glm::value_ptr(v)); }
+		void upload(GLint location, const glm::vec4 &v) { glUniform4fv(location, 1, glm::value_ptr(v)); }
+		void upload(GLint location, const glm::mat3 &v) { glUniformMatrix3fv(location, 1, false, glm::value_ptr(v)); }
+		void upload(GLint location, const glm::mat4 &v) { glUniformMatrix4fv(location, 1, false, glm::value_ptr(v)); }
+	}
+
+
+	shader_program::shader_program(GLuint program) : m_state(std::make_shared<program_state>()) {
+		m_state->program = program;
+		m_state->serial = ++last_program_serial;
+
+		GLuint block = glGetUniformBlockIndex(program, "FrameData");
+		if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, frame_data_binding);
+
+		GLint count = 0;
+		GLint max_length = 0;
+		glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+		std::vector<char> name(std::max(max_length, 1));
+		for (GLint i = 0; i < count; i++) {
+			GLint size = 0;
+			GLenum type = 0;
+			glGetActiveUniform(program, i, GLsizei(name.size()), nullptr, &size, &type, name.data());
+			GLint loc = glGetUniformLocation(program, name.data());
+			if (loc < 0) continue; // member of a uniform block
+
+			// arrays are reported as "name[0]", keep them under the plain name
+			std::string key(name.data());
+			if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0) key.resize(key.size() - 3);
+			m_state->index[key] = int(m_state->slots.size());
+			m_state->slots.emplace_back();
+			m_state->slots.back().location = loc;
+		}
+	}
+
+
+	void shader_program::destroy() {
+		if (!m_state || !m_state->program) return;
+		gpu_release(gpu_kind::program, m_state->program);
+		glDeleteProgram(m_state->program);
+		m_state->program = 0;
+		m_state->serial = 0;
+		m_state->slots.clear();
+		m_state->index.clear();
+	}
+
+
+	int shader_program::find(const std::string &name) const {
+		if (!m_state) return -1;
+		auto it = m_state->index.find(name);
+		return it == m_state->index.end() ? -1 : it->second;
+	}
+
+
+	int shader_program::resolve(shader_uniform &u) const {
+		if (!m_state || !m_state->serial) return -1;
+		if (u.program != m_state->serial) {
+			u.program = m_state->serial;
+			u.index = find(u.name);
+		}
+		return u.index;
+	}
+
+
+	GLint shader_program::location(const std::string &name) const {
+		int i = find(name);
+		return i < 0 ? -1 : m_state->slots[i].location;
+	}
+
+
+	void shader_program::invalidate() {
+		if (!m_state) return;
+		for (auto &u : m_state->slots) u.cached = false;
+	}
+
+
+	template <typename T>
+	void shader_program::set(int index, const T &v) {
+		if (uniform_slot *u = changed(index, v)) upload(u->location, v);
+	}
+
+
+	void shader_program::set_uniform(shader_uniform &u, int v) { set(resolve(u), v); }
+	void shader_program::set_uniform(shader_uniform &u, float v) { set(resolve(u), v); }
+	void shader_program::set_uniform(shader_uniform &u, const glm::vec2 &v) { set(resolve(u), v); }
+	void shader_program::set_uniform(shader_uniform &u, const glm::vec3 &v) { set(resolve(u), v); }
+	void shader_program::set_uniform(shader_uniform &u, const glm::vec4 &v) { set(resolve(u), v); }
+	void shader_program::set_uniform(shader_uniform &u, const glm::mat3 &v) { set(resolve(u), v); }
+	void shader_program::set_uniform(shader_uniform &u, const glm::mat4 &v) { set(resolve(u), v); }
+
+	void shader_program::set_uniform(const std::string &name, int v) { set(find(name), v); }
+	void shader_program::set_uniform(const std::string &name, float v) { set(find(name), v); }
+	void shader_program::set_uniform(const std::string &name, const glm::vec2 &v) { set(find(name), v); }
+	void shader_program::set_uniform(const std::string &name, const glm::vec3 &v) { set(find(name), v); }
+	void shader_program::set_uniform(const std::string &name, const glm::vec4 &v) { set(find(name), v); }
+	void shader_program::set_uniform(const std::string &name, const glm::mat3 &v) { set(find(name), v); }
+	void shader_program::set_uniform(const std::string &name, const glm::mat4 &v) { set(find(name), v); }
+
+
+	namespace {
+		std::string cache_directory;
+
+		// FNV-1a
+		void hash_bytes(uint64_t &h, const void *data, size_t bytes) {
+			const unsigned char *p = static_cast<const unsigned char *>(data);
+			for (size_t i = 0; i < bytes; i++) {
+				h ^= p[i];
+				h *= 1099511628211ull;
+			}
+		}
+
+		void hash_string(uint64_t &h, const char *s) {
+			if (s) hash_bytes(h, s, std::strlen(s) + 1);
+		}
+
+		bool binaries_supported() {
+			if (!GLEW_ARB_get_program_binary && !GLEW_VERSION_4_1) return false;
+			GLint formats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			return formats > 0;
+		}
+
+		bool binary_format_supported(GLenum format) {
+			GLint count = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &count);
+			std::vector<GLint> formats(count);
+			if (count > 0) glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats.data());
+			return std::find(formats.begin(), formats.end(), GLint(format)) != formats.end();
+		}
+	}
+
+
+	void shader_builder::set_cache_directory(const std::string &directory) {
+		cache_directory = directory;
+		if (directory.empty()) return;
+#ifdef _WIN32
+		_mkdir(directory.c_str());
+#else
+		mkdir(directory.c_str(), 0755);
+#endif
+	}
+
+
 	void shader_builder::set_shader(GLenum type, const std::string &filename) {
 		std::ifstream fileStream(filename);
 
@@ -73,21 +268,13 @@ namespace cgra {
 		std::stringstream buffer;
 		buffer << fileStream.rdbuf();
 
-		try {
-			set_shader_source(type, buffer.str());
-		}
-		catch (shader_compile_error &e) {
-			std::cerr << "Error: Could not compile " << filename << std::endl;
-			throw e;
-		}
+		set_shader_source(type, buffer.str());
+		m_stages[type].name = filename;
 	}
 
 
 	void shader_builder::set_shader_source(GLenum type, const std::string &source) {
 
-		// same as GLint shader = glCreateShader(type);
-		gl_object shader = gl_object::gen_shader(type);
-
 		// cgra specific extra (allows different shaders to be defined in a single source)
 		// Start of CGRA addition
 		//
@@ -119,60 +306,189 @@ namespace cgra {
 		}
 		oss << "#define " << get_define(type) << std::endl;
 		oss << iss.rdbuf();
-		std::string final_source = oss.str();
 		//
 		// End of CGRA addition
 
-		// upload and compile the shader
-		const char *text_c = final_source.c_str();
-		glShaderSource(shader, 1, &text_c, nullptr);
-		glCompileShader(shader);
+		m_stages[type] = shader_stage{ oss.str(), std::string() };
+	}
+
 
-		// check compilation status
-		GLint compile_status;
-		glGetShaderiv(shader, GL_COMPILE_STATUS, &compile_status);
-		printShaderInfoLog(shader); // print warnings and errors
-		if (!compile_status) throw shader_compile_error();
+	// cache file for the current stages and driver, empty if there is no cache
+	std::string shader_builder::cache_file() const {
+		if (cache_directory.empty() || !binaries_supported()) return std::string();
+
+		uint64_t h = 14695981039346656037ull;
+		hash_string(h, reinterpret_cast<const char *>(glGetString(GL_VENDOR)));
+		hash_string(h, reinterpret_cast<const char *>(glGetString(GL_RENDERER)));
+		hash_string(h, reinterpret_cast<const char *>(glGetString(GL_VERSION)));
+		for (auto &stage : m_stages) {
+			hash_bytes(h, &stage.first, sizeof(stage.first));
+			hash_string(h, stage.second.source.c_str());
+		}
 
-		m_shaders[type] = std::make_shared<gl_object>(std::move(shader));
+		char name[24];
+		std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)h);
+		return cache_directory + "/" + name;
 	}
 
 
-	GLuint shader_builder::build(GLuint program) {
+	// new program tracked under the owner, labelled with the files of its stages
+	GLuint shader_builder::create_program() const {
+		std::string label;
+		for (auto &stage : m_stages) {
+			if (stage.second.name.empty()) continue;
+			size_t slash = stage.second.name.find_last_of("/\\");
+			if (!label.empty()) label += " + ";
+			label += stage.second.name.substr(slash == std::string::npos ? 0 : slash + 1);
+		}
+		GLuint program = glCreateProgram();
+		CGRA_GPU_TRACK(gpu_kind::program, program, m_owner, label);
+		return program;
+	}
+
+
+	// loads the program from the cache or issues its compile and link, without waiting for either
+	void shader_builder::start(GLuint program) {
 
 		// if the program exists get attached shaders and detach them
-		if (program) {
-			int shader_count = 0;
-			glGetProgramiv(program, GL_ATTACHED_SHADERS, &shader_count);
-
-			if (shader_count > 0) {
-				std::vector<GLuint> attached_shaders(shader_count);
-				int actual_shader_count = 0;
-				glGetAttachedShaders(program, shader_count, &actual_shader_count, attached_shaders.data());
-				for (int i = 0; i < actual_shader_count; i++) {
-					glDetachShader(program, attached_shaders[i]);
-				}
+		int shader_count = 0;
+		glGetProgramiv(program, GL_ATTACHED_SHADERS, &shader_count);
+		if (shader_count > 0) {
+			std::vector<GLuint> attached_shaders(shader_count);
+			int actual_shader_count = 0;
+			glGetAttachedShaders(program, shader_count, &actual_shader_count, attached_shaders.data());
+			for (int i = 0; i < actual_shader_count; i++) {
+				glDetachShader(program, attached_shaders[i]);
 			}
 		}
-		else {
-			program = glCreateProgram();
+
+		m_cacheFile = cache_file();
+		m_fromCache = false;
+		if (!m_cacheFile.empty()) {
+			// [format][binary]
+			std::ifstream file(m_cacheFile, std::ios::binary);
+			GLenum format = 0;
+			if (file.read(reinterpret_cast<char *>(&format), sizeof(format)) && binary_format_supported(format)) {
+				std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+				if (!binary.empty()) {
+					glProgramBinary(program, format, binary.data(), GLsizei(binary.size()));
+					m_fromCache = true;
+					return;
+				}
+			}
 		}
+		compile(program);
+	}
+
+
+	void shader_builder::compile(GLuint program) {
+		m_compiled.clear();
+		for (auto &stage : m_stages) {
+			// same as GLint shader = glCreateShader(type);
+			gl_object shader = gl_object::gen_shader(stage.first);
 
-		// attach shaders
-		for (auto &shader_pair : m_shaders) {
-			glAttachShader(program, *(shader_pair.second));
+			// upload and compile the shader
+			const char *text_c = stage.second.source.c_str();
+			glShaderSource(shader, 1, &text_c, nullptr);
+			glCompileShader(shader);
+			glAttachShader(program, shader);
+			m_compiled.push_back(std::move(shader));
 		}
 
 		// link the program
+		if (!m_cacheFile.empty()) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(program);
+	}
+
+
+	// waits for the program started by start(), reports errors and saves new binaries to the cache
+	shader_program shader_builder::finish(GLuint program) {
+		GLint link_status = 0;
+
+		// a binary from another driver build is rejected, compile it instead
+		if (m_fromCache) {
+			glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+			if (link_status) return shader_program(program);
+			std::cerr << "Warning: Discarding stale program binary " << m_cacheFile << std::endl;
+			m_fromCache = false;
+			compile(program);
+		}
+
+		// check compilation status
+		for (size_t i = 0; i < m_compiled.size(); i++) {
+			GLint compile_status;
+			glGetShaderiv(m_compiled[i], GL_COMPILE_STATUS, &compile_status);
+			printShaderInfoLog(m_compiled[i]); // print warnings and errors
+			if (!compile_status) {
+				GLint type = 0;
+				glGetShaderiv(m_compiled[i], GL_SHADER_TYPE, &type);
+				if (!m_stages[type].name.empty()) std::cerr << "Error: Could not compile " << m_stages[type].name << std::endl;
+				m_compiled.clear();
+				throw shader_compile_error();
+			}
+		}
+		m_compiled.clear();
 
 		// check link status
-		GLint link_status;
 		glGetProgramiv(program, GL_LINK_STATUS, &link_status);
 		printProgramInfoLog(program); // print warnings and errors
 		if (!link_status) throw shader_link_error();
 
-		return program;
+		if (!m_cacheFile.empty()) {
+			GLint length = 0;
+			glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+			std::vector<char> binary(length);
+			GLenum format = 0;
+			if (length > 0) glGetProgramBinary(program, length, &length, &format, binary.data());
+			std::ofstream file(m_cacheFile, std::ios::binary);
+			if (length > 0 && file) {
+				file.write(reinterpret_cast<const char *>(&format), sizeof(format));
+				file.write(binary.data(), length);
+			}
+		}
+
+		return shader_program(program);
+	}
+
+
+	shader_program shader_builder::build(GLuint program) {
+		if (program) {
+			start(program);
+			return finish(program);
+		}
+		program = create_program();
+		try {
+			start(program);
+			return finish(program);
+		} catch (...) {
+			gpu_release(gpu_kind::program, program);
+			glDeleteProgram(program);
+			throw;
+		}
 	}
 
-}
\ No newline at end of file
+
+	std::vector<shader_program> build_programs(std::vector<shader_builder> &builders) {
+		std::vector<GLuint> programs;
+		std::vector<shader_program> built;
+		try {
+			for (auto &b : builders) {
+				programs.push_back(b.create_program());
+				b.start(programs.back());
+			}
+			for (size_t i = 0; i < builders.size(); i++) {
+				built.push_back(builders[i].finish(programs[i]));
+			}
+		} catch (...) {
+			// one failed program takes the whole set down, finished or not
+			for (auto &p : built) p.destroy();
+			for (size_t i = built.size(); i < programs.size(); i++) {
+				gpu_release(gpu_kind::program, programs[i]);
+				glDeleteProgram(programs[i]);
+			}
+			throw;
+		}
+		return built;
+	}
+
+}
@@ -2,9 +2,15 @@
 #pragma once
 
 // std
+#include <cstring>
 #include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+// glm
+#include <glm/glm.hpp>
 
 // project
 #include <opengl.hpp>
@@ -12,16 +18,169 @@
 
 namespace cgra {
 
+	// Camera and light of the frame being drawn, shared by all shaders through the
+	// std140 uniform block FrameData at binding point frame_data_binding:
+	//
+	//   layout(std140) uniform FrameData {
+	//       mat4 uProjectionMatrix;
+	//       mat4 uViewMatrix;
+	//       vec4 uLightDirection;
+	//       vec4 uLightColor;
+	//   };
+	struct frame_data {
+		glm::mat4 projection{ 1 };
+		glm::mat4 view{ 1 };
+		glm::vec4 lightDirection{ 0, -1, 0, 0 }; // viewspace
+		glm::vec4 lightColor{ 0.5, 0.5, 0.5, 1 };
+	};
+
+	const GLuint frame_data_binding = 0;
+
+	// uploads the data of this frame to the buffer behind FrameData,
+	// once per frame before anything is drawn
+	void upload_frame_data(const frame_data &data);
+
+	// deletes the buffer behind FrameData, made again by the next upload
+	void release_frame_data();
+
+
+	// A uniform of a shader_program set through a handle instead of by name. The name is
+	// looked up the first time it is set on a program, later sets go straight to the slot.
+	// Keep one per call site (eg: as a member next to the program) so drawing does not hash
+	// names every frame. Setting it on another program looks the name up again there.
+	struct shader_uniform {
+		const char *name;
+		unsigned long long program = 0; // serial of the program index belongs to
+		int index = -1; // slot in that program, -1 if the uniform is not active
+
+		explicit shader_uniform(const char *name_) : name(name_) { }
+	};
+
+	// A linked shader program with the locations of all its active uniforms
+	// read once at link time. The setters take a shader_uniform handle, or a name
+	// that is looked up in that table, instead of asking the driver, and skip the
+	// upload when the program already holds the value. Like glUniform*, they apply
+	// to the program in use, so call use() first. Copies share the table. The program
+	// is not deleted with them, destroy() deletes it for all of them.
+	// A FrameData block in the program is bound to frame_data_binding.
+	class shader_program {
+	private:
+		struct uniform_slot {
+			GLint location = -1;
+			bool cached = false;
+			unsigned char value[sizeof(glm::mat4)];
+		};
+
+		struct program_state {
+			GLuint program = 0;
+			unsigned long long serial = 0; // unique for every wrapped program, 0 once destroyed
+			std::vector<uniform_slot> slots;
+			std::unordered_map<std::string, int> index; // slot of every uniform name
+		};
+
+		std::shared_ptr<program_state> m_state;
+
+		int find(const std::string &name) const;
+		int resolve(shader_uniform &u) const;
+
+		// slot that should be uploaded, nullptr if it is not active or already holds v
+		template <typename T>
+		uniform_slot * changed(int index, const T &v) {
+			static_assert(sizeof(T) <= sizeof(glm::mat4), "uniform value too large to cache");
+			if (!m_state || index < 0 || index >= int(m_state->slots.size())) return nullptr;
+			uniform_slot &u = m_state->slots[index];
+			if (u.cached && std::memcmp(u.value, &v, sizeof(T)) == 0) return nullptr;
+			std::memcpy(u.value, &v, sizeof(T));
+			u.cached = true;
+			return &u;
+		}
+
+		template <typename T>
+		void set(int index, const T &v);
+
+	public:
+		shader_program() { }
+
+		// wraps a linked program and reflects its active uniforms
+		explicit shader_program(GLuint program);
+
+		GLuint id() const { return m_state ? m_state->program : 0; }
+		explicit operator bool() const { return id() != 0; }
+		bool operator!() const { return id() == 0; }
+
+		void use() const { glUseProgram(id()); }
+
+		// deletes the program, every copy is left empty
+		void destroy();
+
+		// location of an active uniform, or -1
+		GLint location(const std::string &name) const;
+
+		// forgets the cached values, for after the uniforms were set some other way
+		void invalidate();
+
+		void set_uniform(shader_uniform &u, int v);
+		void set_uniform(shader_uniform &u, float v);
+		void set_uniform(shader_uniform &u, const glm::vec2 &v);
+		void set_uniform(shader_uniform &u, const glm::vec3 &v);
+		void set_uniform(shader_uniform &u, const glm::vec4 &v);
+		void set_uniform(shader_uniform &u, const glm::mat3 &v);
+		void set_uniform(shader_uniform &u, const glm::mat4 &v);
+
+		// by name, for code that is not run every frame
+		void set_uniform(const std::string &name, int v);
+		void set_uniform(const std::string &name, float v);
+		void set_uniform(const std::string &name, const glm::vec2 &v);
+		void set_uniform(const std::string &name, const glm::vec3 &v);
+		void set_uniform(const std::string &name, const glm::vec4 &v);
+		void set_uniform(const std::string &name, const glm::mat3 &v);
+		void set_uniform(const std::string &name, const glm::mat4 &v);
+	};
+
+	// Collects the stages of a program and links them. Stages are compiled by build(),
+	// so compile errors are reported there. When a cache directory is set and the driver
+	// supports ARB_get_program_binary, linked programs are saved under a hash of their
+	// sources and the driver, and later builds of the same program load the binary.
 	class shader_builder {
 	private:
-		std::map<GLenum, std::shared_ptr<gl_object>> m_shaders;
+		struct shader_stage {
+			std::string source; // with the stage define added
+			std::string name; // file name for error messages
+		};
+
+		std::map<GLenum, shader_stage> m_stages;
+		std::vector<gl_object> m_compiled; // stages of the program being built
+		std::string m_cacheFile; // binary of the program being built, empty if not cached
+		bool m_fromCache = false;
+		std::string m_owner = "shaders"; // subsystem the programs are tracked under
+
+		void start(GLuint program);
+		void compile(GLuint program);
+		shader_program finish(GLuint program);
+		std::string cache_file() const;
+		GLuint create_program() const;
+
+		friend std::vector<shader_program> build_programs(std::vector<shader_builder> &builders);
 
 	public:
 		shader_builder() { }
 		void set_shader(GLenum type, const std::string &filename);
 		void set_shader_source(GLenum type, const std::string &shadersource);
 
-		GLuint build(GLuint program = 0);
+		// subsystem that owns the built programs, for cgra_resources.hpp (default "shaders")
+		void set_owner(const std::string &owner) { m_owner = owner; }
+
+		// a program made here is deleted again when compiling or linking throws
+		shader_program build(GLuint program = 0);
+
+		// directory for cached program binaries, created if missing, empty disables the cache (default)
+		static void set_cache_directory(const std::string &directory);
 	};
 
+	// Builds several programs at once. Every compile and link is issued before any result is
+	// read back, so drivers that compile in the background (KHR_parallel_shader_compile) work
+	// on all of them at the same time instead of one after another. If any of them fails,
+	// all of them are deleted before the error is rethrown.
+	std::vector<shader_program> build_programs(std::vector<shader_builder> &builders);
+
 }
\ No newline at end of file
@@ -9,7 +9,6 @@ Emitter::Emitter(glm::vec3 location) {
 void Emitter::addParticle() {
 	glm::vec3 start = glm::vec3(origin.x + getRandom(0, 0.5), origin.y, origin.z + getRandom(0, 0.5));
 	Particle p = Particle(start, fire_height);
-	p.shader = shader;
 	p.gravity = gravity;
 	p.scale_f = scale;
 	p.wind = wind;
@@ -41,11 +40,11 @@ void Emitter::update() {
 	}
 }
 
-//draw all particles
-void Emitter::draw(glm::mat4 view, glm::mat4 proj) {
+//append the billboards of all particles
+void Emitter::gather(std::vector<ParticleInstance>& instances) {
 	for (int i = 0; i < particles.size(); i++) {
 		Particle &p = particles.at(i);
-		p.display(view, proj);
+		instances.push_back(p.getInstance());
 	}	
 }
 
@@ -10,13 +10,12 @@ class Emitter {
 public:
 	std::vector<Particle> particles;
 	glm::vec3 origin;
-	GLuint shader = 0;
 	float gravity = 0.1;
 
 	Emitter(glm::vec3 location);
 	void addParticle();
 	void update();
-	void draw(glm::mat4 view, glm::mat4 proj);
+	void gather(std::vector<ParticleInstance>& instances);
 	float getRandom(float low, float high);
 
 	float scale = 0.2;
@@ -0,0 +1,277 @@
+// std
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// glm
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+// project
+#include "opengl.hpp"
+#include "cgra/cgra_mesh.hpp"
+#include "water.hpp"
+#include "water_domain.hpp"
+#include "water_shard.hpp"
+#include "height_sequence.hpp"
+
+using namespace std;
+
+
+// Headless batch runner
+// Steps the water simulation as fast as possible without a window or GL context
+// and writes the height field of every output frame to disk.
+//
+namespace {
+
+	struct headless_options {
+		int n = 200;
+		float width = 100;
+		float radius = 6;
+		float speed = 0.9;
+		float damping = 0.01;
+		float roughness = 1;
+		float waveRate = 2;
+		unsigned seed = 0;
+		int steps = 1000;
+		int every = 1;
+		string out = ".";
+		string sequence;
+		optional<float> minHeight; // default base height - 4 amplitudes
+		optional<float> maxHeight; // default base height + 4 amplitudes
+		int keyInterval = 30;
+		string resume;
+		string checkpoint;
+		int tiles = 1;
+		int shards = 1;
+		bool periodic = false;
+		bool morton = true;
+		int bands = 1;
+		float swell = 0;
+	};
+
+	void printUsage() {
+		cout << "Usage: waveparticles_headless [options]" << endl;
+		cout << "  --n <int>          grid resolution (default 200)" << endl;
+		cout << "  --width <float>    half width of the water (default 100)" << endl;
+		cout << "  --radius <float>   wave particle radius (default 6)" << endl;
+		cout << "  --speed <float>    wave particle speed per step (default 0.9)" << endl;
+		cout << "  --damping <float>  amplitude lost per step (default 0.01)" << endl;
+		cout << "  --roughness <float> wave frequency multiplier (default 1)" << endl;
+		cout << "  --waveRate <float> seconds between waves at roughness 1 (default 2)" << endl;
+		cout << "  --seed <int>       random seed (default 0)" << endl;
+		cout << "  --steps <int>      number of simulation steps (default 1000)" << endl;
+		cout << "  --every <int>      write every k-th step (default 1)" << endl;
+		cout << "  --out <dir>        output directory for raw frames (default .)" << endl;
+		cout << "  --sequence <file>  write a compressed height sequence instead of raw frames" << endl;
+		cout << "  --min <float>      lowest height stored in the sequence (default base height - 4 amplitudes)" << endl;
+		cout << "  --max <float>      highest height stored in the sequence (default base height + 4 amplitudes)" << endl;
+		cout << "  --keyInterval <int> frames between sequence keyframes (default 30)" << endl;
+		cout << "  --resume <file>    continue from a checkpoint, replacing the simulation options above" << endl;
+		cout << "  --checkpoint <file> save the simulation state after the last step" << endl;
+		cout << "  --periodic <0|1>   wrap particles around the edges (default 0)" << endl;
+		cout << "  --morton <0|1>     compact particles along a Z-order curve of cells (default 1)" << endl;
+		cout << "  --bands <int>      radius bands, larger particles are evaluated on coarser grids (default 1)" << endl;
+		cout << "  --swell <float>    particle radius of every second wave, 0 for none (default 0)" << endl;
+		cout << "  --tiles <int>      split the water into tiles x tiles planes simulated in parallel (default 1)" << endl;
+		cout << "  --shards <int>     simulate the tiles in this many worker processes (default 1)" << endl;
+	}
+
+	bool parseOptions(int argc, char **argv, headless_options &opt) {
+		for (int i = 1; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "--help" || arg == "-h") return false;
+			if (i + 1 >= argc) {
+				cerr << "Error: Missing value for " << arg << endl;
+				return false;
+			}
+			string value = argv[++i];
+			try {
+				if (arg == "--n") opt.n = stoi(value);
+				else if (arg == "--width") opt.width = stof(value);
+				else if (arg == "--radius") opt.radius = stof(value);
+				else if (arg == "--speed") opt.speed = stof(value);
+				else if (arg == "--damping") opt.damping = stof(value);
+				else if (arg == "--roughness") opt.roughness = stof(value);
+				else if (arg == "--waveRate") opt.waveRate = stof(value);
+				else if (arg == "--seed") opt.seed = stoul(value);
+				else if (arg == "--steps") opt.steps = stoi(value);
+				else if (arg == "--every") opt.every = stoi(value);
+				else if (arg == "--out") opt.out = value;
+				else if (arg == "--sequence") opt.sequence = value;
+				else if (arg == "--min") opt.minHeight = stof(value);
+				else if (arg == "--max") opt.maxHeight = stof(value);
+				else if (arg == "--keyInterval") opt.keyInterval = stoi(value);
+				else if (arg == "--resume") opt.resume = value;
+				else if (arg == "--checkpoint") opt.checkpoint = value;
+				else if (arg == "--tiles") opt.tiles = stoi(value);
+				else if (arg == "--shards") opt.shards = stoi(value);
+				else if (arg == "--periodic") opt.periodic = stoi(value) != 0;
+				else if (arg == "--morton") opt.morton = stoi(value) != 0;
+				else if (arg == "--bands") opt.bands = stoi(value);
+				else if (arg == "--swell") opt.swell = stof(value);
+				else {
+					cerr << "Error: Unknown option " << arg << endl;
+					return false;
+				}
+			}
+			catch (logic_error &) { // invalid_argument and out_of_range from the conversions
+				cerr << "Error: Invalid value for " << arg << ": " << value << endl;
+				return false;
+			}
+		}
+#ifdef _WIN32
+		if (opt.shards > 1) {
+			cerr << "Error: --shards is only supported on POSIX systems" << endl;
+			return false;
+		}
+#endif
+		// every worker needs at least one tile
+		while (opt.tiles * opt.tiles < opt.shards) opt.tiles++;
+		if (opt.tiles > 1 && opt.periodic) {
+			cerr << "Error: --periodic is not supported with --tiles or --shards" << endl;
+			return false;
+		}
+		if (opt.tiles > 1 && !(opt.resume.empty() && opt.checkpoint.empty())) {
+			cerr << "Error: Checkpoints are not supported with --tiles" << endl;
+			return false;
+		}
+		return opt.n > 1 && opt.every > 0 && opt.tiles > 0 && opt.shards > 0;
+	}
+
+	// writes the heightmap as raw little-endian float32, n x n row major
+	bool writeFrame(const string &dir, int frame, const vector<float> &heights) {
+		ostringstream filename_ss;
+		filename_ss << dir << "/frame_";
+		filename_ss.width(5);
+		filename_ss.fill('0');
+		filename_ss << frame << ".raw";
+
+		ofstream file(filename_ss.str(), ios::binary);
+		if (!file) {
+			cerr << "Error: Could not write " << filename_ss.str() << endl;
+			return false;
+		}
+		file.write(reinterpret_cast<const char *>(heights.data()), heights.size() * sizeof(float));
+		return true;
+	}
+}
+
+
+int main(int argc, char **argv) {
+	headless_options opt;
+	if (!parseOptions(argc, argv, opt)) {
+		printUsage();
+		return 1;
+	}
+
+	water.width = opt.width;
+	water.baseAmp = 0.3 * opt.width;
+	water.radius = opt.radius;
+	water.speed = opt.speed;
+	water.damping = opt.damping;
+	water.roughness = opt.roughness;
+	water.waveRate = opt.waveRate;
+	water.rng.seed(opt.seed);
+	water.periodic = opt.periodic;
+	water.mortonOrder = opt.morton;
+	water.bands = std::max(opt.bands, 1);
+	water.resize(opt.n);
+	if (!opt.resume.empty()) {
+		try {
+			water.loadState(opt.resume);
+		}
+		catch (exception &) {
+			return 1;
+		}
+		opt.n = water.n;
+	}
+
+	// a tiled domain takes its parameters from water and rounds n up to a multiple of the tile count
+	const vector<float> *heightMap = &water.heightMap;
+	unique_ptr<water_domain> domain;
+#ifndef _WIN32
+	// sharded runs fork their workers here, before anything has started OpenMP threads
+	unique_ptr<water_shards> shards;
+	if (opt.shards > 1) {
+		shards.reset(new water_shards(opt.n, opt.width, opt.tiles, opt.shards, water));
+		shards->layout.rng.seed(opt.seed);
+		opt.n = shards->layout.n;
+		heightMap = &shards->layout.heightMap;
+	}
+	else
+#endif
+	if (opt.tiles > 1) {
+		domain.reset(new water_domain(opt.n, opt.width, opt.tiles, water));
+		domain->rng.seed(opt.seed);
+		opt.n = domain->n;
+		heightMap = &domain->heightMap;
+	}
+
+	unique_ptr<height_sequence_writer> sequence;
+	if (!opt.sequence.empty()) {
+		float minHeight = opt.minHeight.value_or(water.baseHeight - 4 * water.baseAmp);
+		float maxHeight = opt.maxHeight.value_or(water.baseHeight + 4 * water.baseAmp);
+		sequence.reset(new height_sequence_writer(opt.sequence, opt.n, minHeight, maxHeight, water.rate * opt.every, opt.keyInterval));
+	}
+
+	// waves are timed in simulated steps so a resumed run keeps the schedule of the run it continues
+	int waveSteps = std::max(int(water.waveRate / water.roughness / water.rate) + 1, 1);
+	int written = 0;
+
+	auto start = chrono::steady_clock::now();
+	for (int step = 0; step < opt.steps; step++) {
+		int ticks = domain ? domain->ticks : water.ticks;
+#ifndef _WIN32
+		if (shards) ticks = shards->layout.ticks;
+#endif
+		// with --swell every second wave is made of large particles
+		bool wave = (ticks + 1) % waveSteps == 0;
+		float waveRadius = (ticks + 1) / waveSteps % 2 == 0 ? opt.swell : 0;
+#ifndef _WIN32
+		if (shards) {
+			if (wave) shards->randWave(waveRadius);
+			shards->tick();
+		}
+		else
+#endif
+		if (domain) {
+			if (wave) domain->randWave(waveRadius);
+			domain->tick();
+		}
+		else {
+			if (wave) water.randWave(waveRadius);
+			water.tick();
+		}
+
+		if (step % opt.every == 0) {
+			if (sequence) sequence->write(heightMap->data());
+			else if (!writeFrame(opt.out, written, *heightMap)) return 1;
+			written++;
+		}
+	}
+	if (sequence) sequence->close();
+	auto end = chrono::steady_clock::now();
+
+	if (!opt.checkpoint.empty()) {
+		try {
+			water.saveState(opt.checkpoint);
+		}
+		catch (exception &) {
+			return 1;
+		}
+	}
+
+	double ms = chrono::duration<double, milli>(end - start).count();
+	cout << "Simulated " << opt.steps << " steps on a " << opt.n << "x" << opt.n << " grid in " << ms << " ms";
+	cout << " (" << ms / std::max(opt.steps, 1) << " ms/step), wrote " << written << " frames to " << (sequence ? opt.sequence : opt.out) << endl;
+}
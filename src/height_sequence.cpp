@@ -0,0 +1,283 @@
+// std
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+// platform
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HEIGHT_SEQUENCE_SSE2
+#include <emmintrin.h>
+#endif
+
+// project
+#include "height_sequence.hpp"
+
+
+static_assert(sizeof(height_sequence_header) == 48, "height_sequence_header must be packed");
+static_assert(sizeof(height_sequence_frame) == 16, "height_sequence_frame must be packed");
+
+
+namespace {
+
+	const uint32_t sequence_version = 1;
+
+	// zero-run compression of 16-bit words: [literal count][literals][zero count] ...
+	void pack(const std::vector<uint16_t> &in, std::vector<uint16_t> &out) {
+		out.clear();
+		size_t i = 0;
+		while (i < in.size()) {
+			size_t start = i;
+			while (i < in.size() && i - start < 0xFFFF && !(in[i] == 0 && i + 1 < in.size() && in[i + 1] == 0)) i++;
+			out.push_back(uint16_t(i - start));
+			out.insert(out.end(), in.begin() + start, in.begin() + i);
+			size_t zeros = i;
+			while (i < in.size() && i - zeros < 0xFFFF && in[i] == 0) i++;
+			out.push_back(uint16_t(i - zeros));
+		}
+	}
+
+	void unpack(const uint16_t *in, size_t words, uint16_t *out, size_t count) {
+		size_t o = 0;
+		size_t i = 0;
+		while (i < words && o < count) {
+			size_t literals = std::min<size_t>(in[i++], count - o);
+			std::memcpy(out + o, in + i, literals * sizeof(uint16_t));
+			i += literals;
+			o += literals;
+			if (i >= words) break;
+			size_t zeros = std::min<size_t>(in[i++], count - o);
+			std::memset(out + o, 0, zeros * sizeof(uint16_t));
+			o += zeros;
+		}
+		if (o != count) throw std::runtime_error("Error: Corrupt height sequence frame");
+	}
+
+	// codes[i] += delta[i], wrapping
+	void addDelta(uint16_t *codes, const uint16_t *delta, size_t count) {
+		size_t i = 0;
+#ifdef HEIGHT_SEQUENCE_SSE2
+		for (; i + 8 <= count; i += 8) {
+			__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + i));
+			__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(delta + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(codes + i), _mm_add_epi16(c, d));
+		}
+#endif
+		for (; i < count; i++) codes[i] = uint16_t(codes[i] + delta[i]);
+	}
+
+	// out[i] = minHeight + codes[i] * scale
+	void dequantize(const uint16_t *codes, size_t count, float minHeight, float scale, float *out) {
+		size_t i = 0;
+#ifdef HEIGHT_SEQUENCE_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 vscale = _mm_set1_ps(scale);
+		const __m128 vmin = _mm_set1_ps(minHeight);
+		for (; i + 8 <= count; i += 8) {
+			__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + i));
+			__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(c, zero));
+			__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(c, zero));
+			_mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(lo, vscale), vmin));
+			_mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_mul_ps(hi, vscale), vmin));
+		}
+#endif
+		for (; i < count; i++) out[i] = minHeight + codes[i] * scale;
+	}
+}
+
+
+height_sequence_writer::height_sequence_writer(const std::string &filename, int size, float minHeight, float maxHeight,
+	float frameTime, int keyInterval, bool compress)
+	: m_file(filename, std::ios::binary), m_compress(compress)
+{
+	if (!m_file) {
+		std::cerr << "Error: Could not open " << filename << " for writing" << std::endl;
+		throw std::runtime_error("Error: Could not open " + filename + " for writing");
+	}
+
+	std::memset(&m_header, 0, sizeof(m_header));
+	std::memcpy(m_header.magic, "WPHS", 4);
+	m_header.version = sequence_version;
+	m_header.size = size;
+	m_header.keyInterval = std::max(keyInterval, 1);
+	m_header.minHeight = minHeight;
+	m_header.maxHeight = std::max(maxHeight, minHeight + 1e-6f);
+	m_header.frameTime = frameTime;
+
+	// placeholder header, rewritten on close
+	m_file.write(reinterpret_cast<const char *>(&m_header), sizeof(m_header));
+	m_codes.resize(size_t(size) * size);
+	m_prev.resize(m_codes.size());
+}
+
+
+height_sequence_writer::~height_sequence_writer() {
+	close();
+}
+
+
+void height_sequence_writer::write(const float *heights) {
+	if (!m_file.is_open()) throw std::runtime_error("Error: Height sequence is already closed");
+
+	float scale = 65535.f / (m_header.maxHeight - m_header.minHeight);
+	for (size_t i = 0; i < m_codes.size(); i++) {
+		float q = std::round((heights[i] - m_header.minHeight) * scale);
+		m_codes[i] = uint16_t(std::min(std::max(q, 0.f), 65535.f));
+	}
+
+	height_sequence_frame frame;
+	frame.offset = uint64_t(m_file.tellp());
+	frame.flags = 0;
+
+	bool key = m_frames.size() % m_header.keyInterval == 0;
+	if (key) {
+		frame.flags |= height_sequence_frame::keyframe;
+		m_prev = m_codes;
+	}
+	else {
+		// store the difference and keep the codes for the next frame
+		for (size_t i = 0; i < m_codes.size(); i++) {
+			uint16_t delta = uint16_t(m_codes[i] - m_prev[i]);
+			m_prev[i] = m_codes[i];
+			m_codes[i] = delta;
+		}
+	}
+
+	const std::vector<uint16_t> *payload = &m_codes;
+	if (m_compress) {
+		pack(m_codes, m_packed);
+		if (m_packed.size() < m_codes.size()) {
+			frame.flags |= height_sequence_frame::compressed;
+			payload = &m_packed;
+		}
+	}
+
+	frame.bytes = uint32_t(payload->size() * sizeof(uint16_t));
+	m_file.write(reinterpret_cast<const char *>(payload->data()), frame.bytes);
+	m_frames.push_back(frame);
+}
+
+
+void height_sequence_writer::close() {
+	if (!m_file.is_open()) return;
+
+	// keep the frame table 8 byte aligned so it can be read in place from the mapping
+	const char zeros[8] = { 0 };
+	m_file.write(zeros, (8 - uint64_t(m_file.tellp()) % 8) % 8);
+
+	m_header.frameCount = uint32_t(m_frames.size());
+	m_header.indexOffset = uint64_t(m_file.tellp());
+	m_file.write(reinterpret_cast<const char *>(m_frames.data()), m_frames.size() * sizeof(height_sequence_frame));
+	m_file.seekp(0);
+	m_file.write(reinterpret_cast<const char *>(&m_header), sizeof(m_header));
+	m_file.close();
+}
+
+
+height_sequence_reader::height_sequence_reader(const std::string &filename) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file != INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		m_bytes = size_t(size.QuadPart);
+		m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping) m_data = static_cast<const unsigned char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		CloseHandle(file);
+	}
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			m_bytes = size_t(st.st_size);
+			void *p = mmap(nullptr, m_bytes, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED) m_data = static_cast<const unsigned char *>(p);
+		}
+		::close(fd);
+	}
+#endif
+	if (!m_data) {
+		std::cerr << "Error: Could not map height sequence " << filename << std::endl;
+		throw std::runtime_error("Error: Could not map height sequence " + filename);
+	}
+
+	std::memset(&m_header, 0, sizeof(m_header));
+	if (m_bytes >= sizeof(m_header)) std::memcpy(&m_header, m_data, sizeof(m_header));
+	if (std::memcmp(m_header.magic, "WPHS", 4) != 0 || m_header.version != sequence_version || m_header.frameCount == 0
+		|| m_header.size == 0 || !(m_header.frameTime > 0) // also rejects NaN
+		|| m_header.indexOffset + uint64_t(m_header.frameCount) * sizeof(height_sequence_frame) > m_bytes) {
+		unmap();
+		std::cerr << "Error: " << filename << " is not a valid height sequence" << std::endl;
+		throw std::runtime_error("Error: " + filename + " is not a valid height sequence");
+	}
+	m_frames = reinterpret_cast<const height_sequence_frame *>(m_data + m_header.indexOffset);
+	m_codes.resize(size_t(m_header.size) * m_header.size);
+}
+
+
+height_sequence_reader::~height_sequence_reader() {
+	unmap();
+}
+
+
+void height_sequence_reader::unmap() {
+#ifdef _WIN32
+	if (m_data) UnmapViewOfFile(m_data);
+	if (m_mapping) CloseHandle(m_mapping);
+#else
+	if (m_data) munmap(const_cast<unsigned char *>(m_data), m_bytes);
+#endif
+	m_data = nullptr;
+	m_mapping = nullptr;
+}
+
+
+// applies frame on top of the codes of frame - 1 (or replaces them for a keyframe)
+void height_sequence_reader::apply(int frame) {
+	const height_sequence_frame &f = m_frames[frame];
+	if (f.offset + f.bytes > m_bytes) throw std::runtime_error("Error: Truncated height sequence frame");
+
+	// uncompressed payloads are used straight from the mapping
+	const uint16_t *words = reinterpret_cast<const uint16_t *>(m_data + f.offset);
+	if (f.flags & height_sequence_frame::compressed) {
+		m_unpacked.resize(m_codes.size());
+		unpack(words, f.bytes / sizeof(uint16_t), m_unpacked.data(), m_unpacked.size());
+		words = m_unpacked.data();
+	}
+	else if (f.bytes != m_codes.size() * sizeof(uint16_t)) {
+		throw std::runtime_error("Error: Corrupt height sequence frame");
+	}
+
+	if (f.flags & height_sequence_frame::keyframe) std::memcpy(m_codes.data(), words, m_codes.size() * sizeof(uint16_t));
+	else addDelta(m_codes.data(), words, m_codes.size());
+	m_current = frame;
+}
+
+
+void height_sequence_reader::decode(int frame, float *out) {
+	frame = std::min(std::max(frame, 0), frameCount() - 1);
+
+	if (frame != m_current) {
+		// step forward from the current frame if we can, otherwise from the last keyframe
+		int start = frame;
+		while (start > 0 && !(m_frames[start].flags & height_sequence_frame::keyframe)) start--;
+		if (m_current >= start && m_current < frame) start = m_current + 1;
+		for (int f = start; f <= frame; f++) apply(f);
+	}
+
+	float scale = (m_header.maxHeight - m_header.minHeight) / 65535.f;
+	dequantize(m_codes.data(), m_codes.size(), m_header.minHeight, scale, out);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+// std
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+// Binary container for a recorded sequence of square height fields.
+//
+// Layout (little-endian):
+//   height_sequence_header
+//   frame payloads
+//   height_sequence_frame table (frameCount entries) at header.indexOffset
+//
+// Heights are quantized to 16 bits over the [minHeight, maxHeight] range of the
+// sequence. Every keyInterval-th frame stores its codes directly, the frames in
+// between store the (wrapping) difference to the previous frame's codes, which is
+// zero wherever the water did not change. A payload may additionally be zero-run
+// compressed: repeated [literal count][literals][zero count] groups of 16-bit words.
+
+struct height_sequence_header {
+	char magic[4];          // "WPHS"
+	uint32_t version;
+	uint32_t size;          // samples per side
+	uint32_t frameCount;
+	uint32_t keyInterval;
+	uint32_t reserved;
+	float minHeight;
+	float maxHeight;
+	float frameTime;        // seconds between frames
+	float pad;
+	uint64_t indexOffset;   // byte offset of the frame table
+};
+
+
+struct height_sequence_frame {
+	enum : uint32_t { keyframe = 1, compressed = 2 };
+	uint64_t offset;        // byte offset of the payload
+	uint32_t bytes;         // payload size
+	uint32_t flags;
+};
+
+
+// Streams frames to disk, the frame table and header are finalized by close()
+class height_sequence_writer {
+private:
+	std::ofstream m_file;
+	height_sequence_header m_header;
+	std::vector<height_sequence_frame> m_frames;
+	std::vector<uint16_t> m_codes;
+	std::vector<uint16_t> m_prev;
+	std::vector<uint16_t> m_packed;
+	bool m_compress = true;
+
+public:
+	height_sequence_writer(const std::string &filename, int size, float minHeight, float maxHeight,
+		float frameTime, int keyInterval = 30, bool compress = true);
+	~height_sequence_writer();
+
+	height_sequence_writer(const height_sequence_writer &) = delete;
+	height_sequence_writer & operator=(const height_sequence_writer &) = delete;
+
+	// heights is size x size floats, row major
+	void write(const float *heights);
+	void close();
+
+	int frameCount() const { return int(m_frames.size()); }
+};
+
+
+// Memory maps a sequence and decodes frames on demand.
+// Frames read in order only apply one delta each, seeking decodes forward from the nearest keyframe.
+class height_sequence_reader {
+private:
+	const unsigned char *m_data = nullptr;
+	size_t m_bytes = 0;
+	void *m_mapping = nullptr; // platform handle of the mapping
+	height_sequence_header m_header;
+	const height_sequence_frame *m_frames = nullptr;
+	std::vector<uint16_t> m_codes; // codes of the last decoded frame
+	std::vector<uint16_t> m_unpacked;
+	int m_current = -1;
+
+	void apply(int frame);
+	void unmap();
+
+public:
+	explicit height_sequence_reader(const std::string &filename);
+	~height_sequence_reader();
+
+	height_sequence_reader(const height_sequence_reader &) = delete;
+	height_sequence_reader & operator=(const height_sequence_reader &) = delete;
+
+	int size() const { return int(m_header.size); }
+	int frameCount() const { return int(m_header.frameCount); }
+	float frameTime() const { return m_header.frameTime; }
+
+	// decodes a frame into out (size x size floats, row major)
+	void decode(int frame, float *out);
+};
@@ -1,13 +1,17 @@
 
 // std
+#include <cstdio>
 #include <iostream>
 #include <string>
 #include <stdexcept>
 
 // project
 #include "application.hpp"
+#include "batch_render.hpp"
 #include "opengl.hpp"
 #include "cgra/cgra_gui.hpp"
+#include "cgra/cgra_resources.hpp"
+#include "cgra/cgra_shader.hpp"
 
 
 using namespace std;
@@ -30,41 +34,104 @@ namespace {
 
 
 // main program
+// options:
+//   --playback <file>      start playing back a baked height sequence instead of simulating
+//   --shader-cache <dir>   where linked shader binaries are kept (default shader_cache, "" disables)
+//   --gpu-budget <MB>      warn when the tracked GPU memory grows past this (default 0, no budget)
+//
+// offscreen batch rendering (no visible window, no GUI):
+//   --offscreen <frames>   render this many frames to PNGs and print the frame times
+//   --size <w>x<h>         framebuffer size (default 800x600)
+//   --camera-path <file>   scripted camera, "time pitch yaw distance" per line (default one orbit)
+//   --frame-time <s>       time per frame for the camera path (default 1/30)
+//   --waves <k>            add a random wave every k frames, 0 for none (default 10)
+//   --output <prefix>      frames are written to <prefix>_000000.png ... (default batch, "" writes none)
+//   --timings <file>       also write the time of every frame as CSV
+//   --egl                  use a surfaceless EGL context instead of a hidden window, for
+//                          machines without a display server (when built with EGL)
 // 
-int main() {
+int main(int argc, char **argv) {
+
+	bool offscreen = false;
+	bool egl = false;
+	batch_options batch;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--egl") egl = true;
+		if (i + 1 >= argc) continue;
+		try {
+			if (arg == "--offscreen") {
+				offscreen = true;
+				batch.frames = stoi(argv[++i]);
+			}
+			else if (arg == "--size") {
+				if (sscanf(argv[++i], "%dx%d", &batch.width, &batch.height) != 2) throw invalid_argument(arg);
+			}
+			else if (arg == "--camera-path") batch.cameraPath = argv[++i];
+			else if (arg == "--frame-time") batch.frameTime = stof(argv[++i]);
+			else if (arg == "--waves") batch.waveInterval = stoi(argv[++i]);
+			else if (arg == "--output") batch.output = argv[++i];
+			else if (arg == "--timings") batch.timings = argv[++i];
+			else if (arg == "--playback") batch.playback = argv[++i];
+			else if (arg == "--gpu-budget") gpu_set_budget(size_t(stod(argv[++i]) * 1048576));
+		}
+		catch (logic_error &) { // invalid_argument and out_of_range from the conversions
+			cerr << "Error: Invalid value for " << arg << ": " << argv[i] << endl;
+			return 1;
+		}
+	}
 
-	// initialize the GLFW library
-	if (!glfwInit()) {
-		cerr << "Error: Could not initialize GLFW" << endl;
-		abort(); // unrecoverable error
+#ifdef CGRA_HAVE_EGL
+	egl = egl && offscreen;
+#else
+	if (egl) cerr << "Warning: Built without EGL, using a hidden window" << endl;
+	egl = false;
+#endif
+
+	GLFWwindow *window = nullptr;
+	if (egl) {
+#ifdef CGRA_HAVE_EGL
+		if (!createEglContext()) abort(); // unrecoverable error
+#endif
 	}
+	else {
+		// initialize the GLFW library
+		if (!glfwInit()) {
+			cerr << "Error: Could not initialize GLFW" << endl;
+			abort(); // unrecoverable error
+		}
 
-	// force OpenGL to create a 3.3 core context
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		// force OpenGL to create a 3.3 core context
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-	// disallow legacy functionality (helps OS X work)
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+		// disallow legacy functionality (helps OS X work)
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 
-	// get the version for GLFW for later
-	int glfwMajor, glfwMinor, glfwRevision;
-	glfwGetVersion(&glfwMajor, &glfwMinor, &glfwRevision);
+		// get the version for GLFW for later
+		int glfwMajor, glfwMinor, glfwRevision;
+		glfwGetVersion(&glfwMajor, &glfwMinor, &glfwRevision);
+		cout << "Using GLFW " << glfwMajor << "." << glfwMinor << "." << glfwRevision << endl;
 
-	// request a debug context so we get debug callbacks
-	// remove this for possible GL performance increases
-	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, true);
+		// request a debug context so we get debug callbacks
+		// remove this for possible GL performance increases
+		glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, true);
 
-	// create a windowed mode window and its OpenGL context
-	GLFWwindow *window = glfwCreateWindow(800, 600, "Hello World!", nullptr, nullptr);
-	if (!window) {
-		cerr << "Error: Could not create GLFW window" << endl;
-		abort(); // unrecoverable error
-	}
+		// offscreen rendering draws into a framebuffer object, the window only holds the context
+		if (offscreen) glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
 
-	// make the window's context current.
-	// if we have multiple windows we will need to switch contexts
-	glfwMakeContextCurrent(window);
+		// create a windowed mode window and its OpenGL context
+		window = glfwCreateWindow(800, 600, "Hello World!", nullptr, nullptr);
+		if (!window) {
+			cerr << "Error: Could not create GLFW window" << endl;
+			abort(); // unrecoverable error
+		}
+
+		// make the window's context current.
+		// if we have multiple windows we will need to switch contexts
+		glfwMakeContextCurrent(window);
+	}
 
 	// initialize GLEW
 	// must be done after making a GL context current (glfwMakeContextCurrent in this case)
@@ -74,14 +141,14 @@ int main() {
 		cerr << "Error: " << glewGetErrorString(err) << endl;
 		abort(); // unrecoverable error
 	}
+	glGetError(); // glewInit can leave GL_INVALID_ENUM behind on core contexts
 
 	// print out our OpenGL versions
 	cout << "Using OpenGL " << glGetString(GL_VERSION) << endl;
 	cout << "Using GLEW " << glewGetString(GLEW_VERSION) << endl;
-	cout << "Using GLFW " << glfwMajor << "." << glfwMinor << "." << glfwRevision << endl;
 
 	// enable GL_ARB_debug_output if available (not necessary, just helpful)
-	if (glfwExtensionSupported("GL_ARB_debug_output")) {
+	if (window ? glfwExtensionSupported("GL_ARB_debug_output") : GLEW_ARB_debug_output) {
 		// this allows the error location to be determined from a stacktrace
 		glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
 		// setup up the callback
@@ -93,6 +160,31 @@ int main() {
 		cout << "GL_ARB_debug_output not available. No worries." << endl;
 	}
 
+
+	// cache linked shaders so later launches skip compiling them
+	string shaderCache = "shader_cache";
+	for (int i = 1; i + 1 < argc; i++) {
+		if (string(argv[i]) == "--shader-cache") shaderCache = argv[++i];
+	}
+	shader_builder::set_cache_directory(shaderCache);
+
+	if (offscreen) {
+		int status = 1;
+		{
+			// playback is loaded by runBatch once the fixed clock is set
+			Application application(window);
+			try { status = runBatch(application, batch); }
+			catch (std::exception &e) { cerr << e.what() << endl; }
+			application.shutdown();
+		}
+		gpu_report_leaks(cerr);
+#ifdef CGRA_HAVE_EGL
+		if (egl) destroyEglContext();
+#endif
+		if (window) glfwTerminate();
+		return status;
+	}
+
 	// initialize ImGui
 	if (!cgra::gui::init(window)) {
 		cerr << "Error: Could not initialize ImGui" << endl;
@@ -105,12 +197,15 @@ int main() {
 	glfwSetScrollCallback(window, scrollCallback);
 	glfwSetKeyCallback(window, keyCallback);
 	glfwSetCharCallback(window, charCallback);
-
 	
 	// create the application object (and a global pointer to it)
 	Application application(window);
 	application_ptr = &application;
 
+	for (int i = 1; i + 1 < argc; i++) {
+		if (string(argv[i]) == "--playback") application.loadPlayback(argv[++i]);
+	}
+
 	// loop until the user closes the window
 	while (!glfwWindowShouldClose(window)) {
 
@@ -131,8 +226,14 @@ int main() {
 		glfwPollEvents();
 	}
 
+	// finish writing captures while the context still exists
+	application.shutdown();
+
 	// clean up ImGui
 	cgra::gui::shutdown();
+
+	// anything left over was never released by its owner
+	gpu_report_leaks(cerr);
 	glfwTerminate();
 }
 
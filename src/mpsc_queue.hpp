@@ -0,0 +1,60 @@
+#pragma once
+
+// std
+#include <atomic>
+#include <utility>
+
+
+// Unbounded multi-producer single-consumer queue.
+// Any number of threads can push() without locking (one atomic exchange per push),
+// while a single consumer thread drains it with pop(). Nodes are linked behind a stub
+// so producers never touch the consumer's end of the list.
+template <typename T>
+class mpsc_queue {
+private:
+	struct node {
+		std::atomic<node *> next{ nullptr };
+		T value;
+
+		node() { }
+		explicit node(T &&v) : value(std::move(v)) { }
+	};
+
+	std::atomic<node *> m_head; // last pushed node, written by producers
+	node *m_tail; // stub node in front of the next value, owned by the consumer
+
+public:
+	mpsc_queue() {
+		m_tail = new node();
+		m_head.store(m_tail);
+	}
+
+	// not copyable, the nodes are owned by this queue
+	mpsc_queue(const mpsc_queue &) = delete;
+	mpsc_queue & operator=(const mpsc_queue &) = delete;
+
+	~mpsc_queue() {
+		while (m_tail) {
+			node *next = m_tail->next.load();
+			delete m_tail;
+			m_tail = next;
+		}
+	}
+
+	// safe to call from any thread
+	void push(T value) {
+		node *n = new node(std::move(value));
+		node *prev = m_head.exchange(n, std::memory_order_acq_rel);
+		prev->next.store(n, std::memory_order_release);
+	}
+
+	// consumer only, returns false if nothing is (fully) pushed yet
+	bool pop(T &out) {
+		node *next = m_tail->next.load(std::memory_order_acquire);
+		if (!next) return false;
+		out = std::move(next->value);
+		delete m_tail;
+		m_tail = next;
+		return true;
+	}
+};
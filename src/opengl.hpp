@@ -18,15 +18,8 @@ namespace cgra {
 
 	// helper function that draws an empty OpenGL object
 	// can be used for shaders that do all the work
-	inline void draw_dummy(unsigned instances = 1) {
-		static GLuint vao = 0;
-		if (vao == 0) {
-			glGenVertexArrays(1, &vao);
-		}
-		glBindVertexArray(vao);
-		glDrawArraysInstanced(GL_POINTS, 0, 1, instances);
-		glBindVertexArray(0);
-	}
+	// (defined in cgra_geometry.cpp, its vertex array is released by releaseGeometry)
+	void draw_dummy(unsigned instances = 1);
 
 
 	// gl_object is a helper class that wraps around a GLuint
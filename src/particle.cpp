@@ -1,4 +1,4 @@
-#include "Particle.hpp"
+#include "particle.hpp"
 
 //Perlin imports
 #define STB_PERLIN_IMPLEMENTATION
@@ -33,7 +33,6 @@ void Particle::update()
 	float windLZ = lrg_wind;
 	float CZ = C;
 	float windSZ = dot((location - origin), glm::vec3(-gravity)) * CZ * NZ;
-	float kZ = wind;
 	float deltaVZ = (k * gravity) + windLZ + windSZ;
 	//float deltaVZ = N;
 
@@ -52,11 +51,9 @@ void Particle::update()
 	lifespan--;
 }
 
-//draw particle
-void Particle::display(glm::mat4 view, glm::mat4 proj)
+//billboard of the particle for this frame, fading with its lifespan
+ParticleInstance Particle::getInstance()
 {
-	glm::mat4 translated = translate(view, location);
-
 	// opacity
 	if (alpha) {
 		color.a = (lifespan / startLifespan); 
@@ -73,19 +70,8 @@ void Particle::display(glm::mat4 view, glm::mat4 proj)
 	float scaleY = (lifespan / startLifespan);// *0.032;
 	scaleX *= scale_f; //scale down further 
 	scaleY *= scale_f;
-	translated = scale(translated, glm::vec3(scaleX, scaleY, scale_f));
-
-	glUseProgram(shader); // load shader and variables
-	glUniformMatrix4fv(glGetUniformLocation(shader, "uProjectionMatrix"), 1, false, value_ptr(proj));
-	glUniformMatrix4fv(glGetUniformLocation(shader, "uModelViewMatrix"), 1, false, value_ptr(translated));
-	glUniform4fv(glGetUniformLocation(shader, "baseColor"), 1, value_ptr(color));
-	glUniform4fv(glGetUniformLocation(shader, "emColor"), 1, value_ptr(emColor));
-	glUniform4fv(glGetUniformLocation(shader, "amColor"), 1, value_ptr(amColor));
-	glUniform4fv(glGetUniformLocation(shader, "diffColor"), 1, value_ptr(diffColor));
-	glUniform4fv(glGetUniformLocation(shader, "specColor"), 1, value_ptr(specColor));
-	glUniform1f(glGetUniformLocation(shader, "shininess"), shine);
 
-	cgra::drawSphere();
+	return ParticleInstance{ location, glm::vec2(scaleX, scaleY), color, emColor, amColor, diffColor, specColor, shine };
 }
 
 //check if particle is dead
@@ -11,18 +11,29 @@
 #include <random>
 
 
+//Per-instance data of one particle billboard, read by the fire shaders as vertex attributes.
+struct ParticleInstance {
+	glm::vec3 location;
+	glm::vec2 size; //half extents of the billboard
+	glm::vec4 color;
+	glm::vec4 emColor;
+	glm::vec4 amColor;
+	glm::vec4 diffColor;
+	glm::vec4 specColor;
+	float shininess;
+};
+
+
 class Particle
 {
 public:
 	Particle(glm::vec3 l, float lifespan);
 
-	GLuint shader = 0;
-
 	float gravity;
 	float yVelocity;
 
 	void update();
-	void display(glm::mat4 view, glm::mat4 proj);
+	ParticleInstance getInstance();
 	bool isDead();
 	float getRandom(float low, float high);
 
@@ -1,10 +1,11 @@
 #include "particle_system.hpp"
+#include <cgra/cgra_resources.hpp>
 
 //default constructor
 ParticleSystem::ParticleSystem() {}
 
 //constructor
-ParticleSystem::ParticleSystem(GLuint shader)
+ParticleSystem::ParticleSystem(cgra::shader_program shader)
 {
 	//generates [density] number of particle systems in range (0, [radius])
 	while (systems.size() < density) {
@@ -15,7 +16,6 @@ ParticleSystem::ParticleSystem(GLuint shader)
 	//adds one emitter to each particle system
 	for (int i = 0; i < systems.size(); i++) {
 		Emitter& e = systems.at(i);
-		e.shader = shader;
 		e.scale = scale_f;
 		e.wind = wind;
 		e.addParticle();
@@ -47,7 +47,6 @@ void ParticleSystem::update() {
 		Emitter newEm = Emitter(glm::vec3(getRandom(x - radius, x + radius), y - 0.5, getRandom(z - radius, z)));
 		//Emitter newEm = Emitter(glm::vec3(x, y, z));
 
-		newEm.shader = shader;
 		newEm.addParticle();
 		systems.push_back(newEm);
 	}
@@ -76,30 +75,97 @@ void ParticleSystem::update() {
 }
 
 //draw all emitters in particle system
-void ParticleSystem::draw(glm::mat4 view, glm::mat4 proj) {
+void ParticleSystem::draw(const cgra::frustum& clip) {
 	float scalar = 3;
 
-	glm::mat4 translated = translate(view, glm::vec3(x, y, z - (2.5 * scalar)));
+	glm::mat4 translated = translate(glm::mat4(1), glm::vec3(x, y, z - (2.5 * scalar)));
 	translated = scale(translated, glm::vec3(0.5 * scalar, 0.5 * scalar, 5.0 * scalar));
 
-	glUseProgram(logShader); // load shader and variables
-	glUniformMatrix4fv(glGetUniformLocation(logShader, "uProjectionMatrix"), 1, false, value_ptr(proj));
-	glUniformMatrix4fv(glGetUniformLocation(logShader, "uModelViewMatrix"), 1, false, value_ptr(translated));
-	glUniform3fv(glGetUniformLocation(logShader, "uColor"), 1, value_ptr(glm::vec3(0.388, 0.192, 0)));
+	logShader.use(); // load shader and variables, the camera comes from FrameData
+	logShader.set_uniform(logModel, translated);
+	logShader.set_uniform(logColor, glm::vec3(0.388, 0.192, 0));
 	cgra::drawCylinder();
 	
 	//translate, rotate, scale second log to be leaning on other 
-	glm::mat4 translated2 = translate(view, glm::vec3(x - (2.8 * scalar), y - (0.3 * scalar), z));
+	glm::mat4 translated2 = translate(glm::mat4(1), glm::vec3(x - (2.8 * scalar), y - (0.3 * scalar), z));
 	translated2 = rotate(translated2, glm::radians(90.0f), glm::vec3(0.0, 1.0, 0.0));
 	translated2 = rotate(translated2, glm::radians(-20.0f), glm::vec3(1.0, 0.0, 0.0));
 	translated2 = scale(translated2, glm::vec3(0.5 * scalar, 0.5 * scalar, 5.0 * scalar));
 
-	glUniformMatrix4fv(glGetUniformLocation(logShader, "uModelViewMatrix"), 1, false, value_ptr(translated2));
+	logShader.set_uniform(logModel, translated2);
 	cgra::drawCylinder();
 
+	//gather every live particle and draw them all as camera facing quads in one instanced call,
+	//leaving out emitters whose billboards are all outside the view or too far away to see
+	instances.clear();
+	culledEmitters = 0;
 	for (int i = 0; i < systems.size(); i++) {
-		systems.at(i).draw(view, proj);
+		size_t first = instances.size();
+		systems.at(i).gather(instances);
+		if (first == instances.size()) continue;
+		glm::vec3 lo = instances[first].location;
+		glm::vec3 hi = lo;
+		for (size_t k = first; k < instances.size(); k++) {
+			float r = std::max(instances[k].size.x, instances[k].size.y);
+			lo = glm::min(lo, instances[k].location - r);
+			hi = glm::max(hi, instances[k].location + r);
+		}
+		if (!clip.intersects(lo, hi) || !clip.within(lo, hi, cullDistance)) {
+			instances.resize(first);
+			culledEmitters++;
+		}
 	}
+	if (instances.empty()) return;
+	if (!instanceVAO) createInstanceBuffer();
+
+	glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+	if (instances.size() > instanceCapacity) instanceCapacity = std::max(instances.size(), 2 * instanceCapacity);
+	glBufferData(GL_ARRAY_BUFFER, instanceCapacity * sizeof(ParticleInstance), nullptr, GL_STREAM_DRAW);
+	cgra::gpu_resize(cgra::gpu_kind::buffer, instanceVBO, instanceCapacity * sizeof(ParticleInstance));
+	glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(ParticleInstance), instances.data());
+
+	shader.use();
+	glBindVertexArray(instanceVAO);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(instances.size()));
+	glBindVertexArray(0);
+}
+
+//creates the instance buffer and the VAO reading ParticleInstance attributes from it,
+//the quad corners come from gl_VertexID so there is no vertex buffer
+void ParticleSystem::createInstanceBuffer() {
+	glGenVertexArrays(1, &instanceVAO);
+	glGenBuffers(1, &instanceVBO);
+	CGRA_GPU_TRACK(cgra::gpu_kind::vertex_array, instanceVAO, "fire", "particles");
+	CGRA_GPU_TRACK(cgra::gpu_kind::buffer, instanceVBO, "fire", "particles");
+	glBindVertexArray(instanceVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+
+	const GLint sizes[] = { 3, 2, 4, 4, 4, 4, 4, 1 };
+	const size_t offsets[] = {
+		offsetof(ParticleInstance, location),
+		offsetof(ParticleInstance, size),
+		offsetof(ParticleInstance, color),
+		offsetof(ParticleInstance, emColor),
+		offsetof(ParticleInstance, amColor),
+		offsetof(ParticleInstance, diffColor),
+		offsetof(ParticleInstance, specColor),
+		offsetof(ParticleInstance, shininess)
+	};
+	for (int a = 0; a < 8; a++) {
+		glEnableVertexAttribArray(a);
+		glVertexAttribPointer(a, sizes[a], GL_FLOAT, GL_FALSE, sizeof(ParticleInstance), (void *)offsets[a]);
+		glVertexAttribDivisor(a, 1);
+	}
+	glBindVertexArray(0);
+}
+
+void ParticleSystem::releaseGL() {
+	cgra::gpu_release(cgra::gpu_kind::vertex_array, instanceVAO);
+	cgra::gpu_release(cgra::gpu_kind::buffer, instanceVBO);
+	glDeleteVertexArrays(1, &instanceVAO);
+	glDeleteBuffers(1, &instanceVBO);
+	instanceVAO = instanceVBO = 0;
+	instanceCapacity = 0;
 }
 
 //Helper method to get random number in range
@@ -1,27 +1,43 @@
 #pragma once
+#include <algorithm>
+#include <cstddef>
 #include <vector>
 #include <emitter.hpp>
+#include <cgra/cgra_mesh.hpp>
+#include <cgra/cgra_shader.hpp>
 #include <glm/glm.hpp>
 
 class ParticleSystem {
 public: 
 	ParticleSystem();
-	ParticleSystem(GLuint shader);
+	ParticleSystem(cgra::shader_program shader);
 	void update();
-	void draw(glm::mat4 view, glm::mat4 proj);
+	void draw(const cgra::frustum& clip); //clip is the world space view volume
 	float getRandom(float low, float high);
 	void parameters(float radius, float wind, float density, float scale, float lrg_wind, float fire_height, bool alpha);
+	void releaseGL(); //deletes the instance buffer, the shaders belong to the application
 
 	std::vector<Emitter> systems;
-	GLuint shader = 0;
-	GLuint logShader = 0;
+	cgra::shader_program shader;
+	cgra::shader_program logShader;
+	cgra::shader_uniform logModel{ "uModelMatrix" };
+	cgra::shader_uniform logColor{ "uColor" };
 	float prevRadius = 5;
 	float radius = 1.0;
 	float wind = 0.04; 
 	float density = 50;
 	float scale_f = 0.2;
 	float lrg_wind = 0.0;
+
+	//one billboard per live particle, uploaded to instanceVBO every frame
+	std::vector<ParticleInstance> instances;
+	GLuint instanceVAO = 0;
+	GLuint instanceVBO = 0;
+	size_t instanceCapacity = 0;
+	float cullDistance = 400; //emitters further than this from the camera are a few pixels at most, and not drawn
+	int culledEmitters = 0; //emitters outside the view or beyond cullDistance in the last draw
 private:
+	void createInstanceBuffer();
 	//origin positions
 	float x = -25;
 	float y = 20.5;
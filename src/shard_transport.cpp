@@ -0,0 +1,90 @@
+// std
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+// project
+#include "shard_transport.hpp"
+
+#ifndef _WIN32
+
+// platform
+#include <sys/socket.h>
+#include <unistd.h>
+
+// a peer that died must surface as a write error, not a SIGPIPE that kills the coordinator;
+// platforms without MSG_NOSIGNAL set SO_NOSIGPIPE on the sockets instead
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+socket_transport::~socket_transport() {
+	close();
+}
+
+
+std::pair<std::unique_ptr<socket_transport>, std::unique_ptr<socket_transport>> socket_transport::pair() {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		std::cerr << "Error: Could not create socket pair: " << std::strerror(errno) << std::endl;
+		throw std::runtime_error("Error: Could not create socket pair");
+	}
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	for (int fd : fds) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	return std::make_pair(std::unique_ptr<socket_transport>(new socket_transport(fds[0])), std::unique_ptr<socket_transport>(new socket_transport(fds[1])));
+}
+
+
+void socket_transport::close() {
+	if (m_fd >= 0) ::close(m_fd);
+	m_fd = -1;
+}
+
+
+void socket_transport::writeAll(const void *data, size_t bytes) {
+	const char *p = static_cast<const char *>(data);
+	while (bytes > 0) {
+		ssize_t written = ::send(m_fd, p, bytes, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) throw std::runtime_error(std::string("Error: Shard transport write failed: ") + std::strerror(errno));
+		p += written;
+		bytes -= size_t(written);
+	}
+}
+
+
+bool socket_transport::readAll(void *data, size_t bytes) {
+	char *p = static_cast<char *>(data);
+	while (bytes > 0) {
+		ssize_t got = ::read(m_fd, p, bytes);
+		if (got < 0 && errno == EINTR) continue;
+		if (got == 0) return false;
+		if (got < 0) throw std::runtime_error(std::string("Error: Shard transport read failed: ") + std::strerror(errno));
+		p += got;
+		bytes -= size_t(got);
+	}
+	return true;
+}
+
+
+void socket_transport::send(const std::vector<char> &message) {
+	uint64_t bytes = message.size();
+	writeAll(&bytes, sizeof(bytes));
+	writeAll(message.data(), message.size());
+}
+
+
+bool socket_transport::receive(std::vector<char> &message) {
+	uint64_t bytes = 0;
+	if (!readAll(&bytes, sizeof(bytes))) return false;
+	message.resize(size_t(bytes));
+	if (!readAll(message.data(), message.size())) throw std::runtime_error("Error: Shard transport closed mid message");
+	return true;
+}
+
+#endif
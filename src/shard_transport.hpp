@@ -0,0 +1,50 @@
+#pragma once
+
+// std
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+// Point to point message channel between the processes of a sharded simulation.
+// Messages are delivered whole and in order. Implementations for other transports
+// (shared memory, TCP between nodes) only need to provide send and receive.
+class shard_transport {
+public:
+	virtual ~shard_transport() { }
+
+	// blocks until the whole message is written
+	virtual void send(const std::vector<char> &message) = 0;
+
+	// blocks until the next message arrives, returns false once the other end is closed
+	virtual bool receive(std::vector<char> &message) = 0;
+};
+
+
+#ifndef _WIN32
+
+// Local transport over a connected Unix domain stream socket.
+// Each message is framed by its length as a 64-bit prefix.
+class socket_transport : public shard_transport {
+private:
+	int m_fd = -1;
+
+	void writeAll(const void *data, size_t bytes);
+	bool readAll(void *data, size_t bytes);
+
+public:
+	explicit socket_transport(int fd) : m_fd(fd) { }
+	~socket_transport();
+
+	socket_transport(const socket_transport &) = delete;
+	socket_transport & operator=(const socket_transport &) = delete;
+
+	// creates two connected endpoints, one for each side of a fork()
+	static std::pair<std::unique_ptr<socket_transport>, std::unique_ptr<socket_transport>> pair();
+
+	void send(const std::vector<char> &message) override;
+	bool receive(std::vector<char> &message) override;
+	void close();
+};
+
+#endif
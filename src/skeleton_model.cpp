@@ -13,10 +13,9 @@ using namespace glm;
 using namespace cgra;
 
 
-void skeleton_model::draw(const mat4 &view, const mat4 &proj) {
-	// set up the shader for every draw call
-	glUseProgram(shader);
-	glUniformMatrix4fv(glGetUniformLocation(shader, "uProjectionMatrix"), 1, false, value_ptr(proj));
+void skeleton_model::draw(const mat4 &view, const mat4 &/*proj*/) {
+	// set up the shader for every draw call, the projection comes from FrameData
+	shader.use();
 
 	// if the skeleton is not empty, then draw
 	if (!skel.bones.empty()) {
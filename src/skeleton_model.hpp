@@ -5,6 +5,7 @@
 
 // project
 #include "opengl.hpp"
+#include "cgra/cgra_shader.hpp"
 #include "skeleton.hpp"
 
 class skeleton_model {
@@ -13,7 +14,7 @@ private:
 	void drawBone(const glm::mat4 &view, int boneid);
 
 public:
-	GLuint shader = 0;
+	cgra::shader_program shader;
 	skeleton_data skel;
 	skeleton_pose pose;
 
@@ -1,7 +1,30 @@
 #pragma once
 
+// std
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
 // project
 #include "cgra/cgra_geometry.hpp"
+#include "cgra/cgra_resources.hpp"
+#include "cgra/cgra_shader.hpp"
+#include "mpsc_queue.hpp"
+
+#ifdef CGRA_HAVE_OPENMP
+#include <omp.h>
+#endif
 
 
 using namespace std;
@@ -14,50 +37,264 @@ struct waveParticle {
 	glm::vec2 direction;
 	float amplitude;
 	float displacement(glm::vec2 x);
-	float rf(float x);
+	float rf(float x) const;
 	float radius = 6;
 	float dispAng;
 	float speed = 0.9;
+	int cell = -1; //flattened cellMap index the particle is binned in, -1 when unbinned
+	int slot = -1; //position of the particle inside its cell
+};
+
+static_assert(std::is_trivially_copyable<waveParticle>::value, "waveParticle is saved with memcpy");
+
+//A connected run of particles. Closed fronts also connect the last particle back to the first.
+struct waveFront {
+	std::vector<int> ids;
+	bool closed = true;
+};
+
+//A wave to add to the water. Events can be pushed from any thread and are applied
+//at the start of the next simulation tick.
+struct waveEvent {
+	enum kind_t { drop, front, batch, ring, arc };
+	kind_t kind = drop;
+	glm::vec2 position{ 0 }; //centre of a drop, front, ring or arc
+	glm::vec2 direction{ 1, 0 }; //travel direction of a directional front
+	float length = 0; //span of a directional front, or radius of a ring or arc
+	float startAngle = 0; //angles of an arc in radians
+	float endAngle = 0;
+	float amplitude = 0; //0 uses the plane's baseAmp
+	float radius = 0; //particle radius, 0 uses the plane's radius
+	bool closed = true; //whether a batch front wraps around
+	std::vector<waveParticle> particles; //particles of a batch, added as one front
+};
+
+
+//Interleaves the bits of i and j, i in the odd bits.
+inline uint32_t mortonCode(uint32_t i, uint32_t j) {
+	auto spread = [](uint32_t x) {
+		x &= 0xFFFF;
+		x = (x | (x << 8)) & 0x00FF00FF;
+		x = (x | (x << 4)) & 0x0F0F0F0F;
+		x = (x | (x << 2)) & 0x33333333;
+		x = (x | (x << 1)) & 0x55555555;
+		return x;
+	};
+	return (spread(i) << 1) | spread(j);
+}
+
+//Cells of an n x n grid (row major indices) sorted by Morton code, with an LSD radix sort
+//over the code bytes. Passes over bytes that are zero for every cell are skipped.
+inline void sortCellsMorton(int n, std::vector<int>& order) {
+	std::vector<uint32_t> keys(n * n), keys2(n * n);
+	std::vector<int> order2(n * n);
+	order.resize(n * n);
+	for (int c = 0; c < n * n; c++) {
+		keys[c] = mortonCode(c / n, c % n);
+		order[c] = c;
+	}
+	uint32_t top = mortonCode(n - 1, n - 1);
+	for (int shift = 0; shift < 32 && (top >> shift) != 0; shift += 8) {
+		int count[257] = { 0 };
+		for (uint32_t k : keys) count[((k >> shift) & 0xFF) + 1]++;
+		for (int b = 0; b < 256; b++) count[b + 1] += count[b];
+		for (int c = 0; c < n * n; c++) {
+			int to = count[(keys[c] >> shift) & 0xFF]++;
+			keys2[to] = keys[c];
+			order2[to] = order[c];
+		}
+		keys.swap(keys2);
+		order.swap(order2);
+	}
+}
+
+
+//The water surface at one queried point.
+struct waterSample {
+	float height = 0;
+	glm::vec3 normal{ 0, 1, 0 };
+	float velocity = 0; //vertical speed of the surface in units per second
+};
+
+//A band of large particles, evaluated on a grid scale times coarser than the water
+//and upsampled into it. Rebuilt every tick from the fronts.
+struct waveBand {
+	int scale = 2; //water cells per band cell
+	int size = 0; //band cells per side
+	std::vector<int> start; //first entry of each band cell in ids, size * size + 1 offsets
+	std::vector<int> ids; //particle ids grouped by band cell
+	std::vector<float> heights; //displacement at each of the (size + 1)^2 band vertices
+	std::vector<bool> live; //band vertices with particles in reach
 };
 
 
 struct water_plane {
-	GLuint shader = 0;
+	shader_program shader;
+	//uniforms draw() sets on shader
+	shader_uniform uColor{ "uColor" }, uAmbient{ "ambientStrength" }, uSpecular{ "specularStrength" }, uModel{ "uModelMatrix" };
 	cgra::gl_mesh mesh;
 	glm::vec3 wcolor = glm::vec3(0.08, 0.51, 1);
 	glm::vec3 gcolor = glm::vec3(0.0, 0.0, 1);
 	glm::vec3 color;
 	glm::mat4 modelTransform{ 1.0 };
 	GLuint texture;
-	std::vector<std::vector<waveParticle>> waveFronts{};
+	std::vector<waveParticle> particles{}; //particle store, fronts and cells hold indices into it
+	std::vector<int> freeParticles{};
+	std::vector<waveFront> waveFronts{};
 	cgra::mesh_builder createSurface();
 	float lastTick = 0;
 	float lastWave = 0;
 	float rate = 0.01;
-	const static int n = 200;
-	float heightMap[n][n] = { 0 };
-	std::vector<waveParticle> cellMap[n][n];
+	int n = 200;
+	std::vector<float> heightMap; //n x n heights, row major
+	std::vector<std::vector<int>> cellMap; //particle ids per cell, row major
+	water_plane() { resize(n); }
+	void resize(int size);
 	float width = 100;
 	float threshold = 0.01;
 	float baseHeight = 12;
 	float baseAmp = 0.3 * width;
-	void draw(const glm::mat4& view, const glm::mat4 proj);
+	//Draws the tiles (or LOD patches) inside clip, the world space view volume
+	void draw(const glm::mat4& view, const glm::mat4 proj, const cgra::frustum& clip);
 	//Simulates the water at a given time
 	void simulate();
-	//Runs the math to get the heightMap for the water.
+	//Advances the simulation one step without touching OpenGL
+	void tick();
+	//Runs the math to get the heightMap for the water. Only tiles near particles are re-evaluated.
 	void getHMap();
 	float eta(glm::vec2 x);
 	void  iterate();
 	void visualize(const glm::mat4& view, const glm::mat4 proj);
-	std::vector<waveParticle> getAdjacent(glm::vec2 p, int n, int rad);
-	void randWave();
+	void randWave(float waveRadius = 0);
+	mpsc_queue<waveEvent> waveEvents;
+	void addWave(waveEvent e);
+	void drainEvents();
+	void spawnDrop(glm::vec2 p, float amplitude);
+	void spawnFront(glm::vec2 p, glm::vec2 dir, float length, float amplitude);
+	void spawnBatch(const std::vector<waveParticle>& batch, bool closed);
+
+	//Bulk wave sources. Fronts are emitted fully resolved, with neighbours no further than half a
+	//particle radius apart at resolveRadius (or their starting radius if larger), in one allocation.
+	float radius = 6;
+	float speed = 0.9;
+	int emitRing(glm::vec2 centre, float ringRadius, float amplitude, float resolveRadius = 0);
+	int emitArc(glm::vec2 centre, float ringRadius, float startAngle, float endAngle, float amplitude, float resolveRadius = 0);
+	int emitLine(glm::vec2 a, glm::vec2 b, glm::vec2 dir, float amplitude);
+	waveFront& bulkFront(int count, bool closed);
+	void binFront(const waveFront& front);
 	void generateWaveParticles();
 	float waveRate = 2;
 	bool playing;
+	std::default_random_engine rng;
 	float roughness = 1;
 	float damping = 0.01;
 	float adjacent = 4;
 	bool viz = false;
+
+	//Dirty-tile tracking. The grid is split into tileSize x tileSize tiles and a tile is
+	//active when a particle lies within the neighbour lookup window of any of its vertices.
+	const static int tileSize = 8;
+	int tiles = 0;
+	std::vector<bool> activeTiles;
+	std::vector<bool> lastActiveTiles;
+	std::vector<bool> dirtyTiles;
+	void markTiles(int j, int k, std::vector<bool>& mask, int reach = 0);
+
+	//Frustum culling. The mesh indices are grouped by tile so each tile is one range of the index
+	//buffer, drawn only when its box (the tile's cells and the height range of their vertices) is
+	//in view. The LOD patches are tested against the height range of the whole surface.
+	std::vector<glm::vec2> tileHeights; //lowest and highest height of each tile's own vertices
+	std::vector<GLint> tileFirstIndex; //start of each tile's indices in mesh, tiles * tiles + 1 entries
+	int culledTiles = 0; //tiles (or LOD patches) outside the view in the last draw
+	void updateTileHeights(int t);
+	void tileBounds(int t, glm::vec3& lo, glm::vec3& hi) const;
+	void tileVertices(int start, std::vector<int>& out);
+	glm::vec3 surfaceNormal(int i, int j);
+	void updateSurface();
+	void setHeights(const float* heights);
+
+	//Incremental spatial index. Particles stay in their cell between ticks and are only
+	//moved when they cross a cell boundary; every compactRate ticks the store is rebuilt in cell order.
+	//With mortonOrder the cells are walked along a Z-order curve so the particles of neighbouring
+	//rows of cells also end up close in memory.
+	int compactRate = 64;
+	int ticks = 0;
+	bool mortonOrder = true;
+	std::vector<int> cellOrder; //cells in Morton order, built by resize()
+	int cellOf(glm::vec2 position) const;
+	int newParticle(const waveParticle& p);
+	void killParticle(int id);
+	void bin(int id, int c);
+	void unbin(int id);
+	void compact();
+
+	//Periodic domain. Particles leaving one side come back on the other and the cell lookups
+	//and distances wrap, so the surface tiles seamlessly. The mesh gets an extra row and column
+	//repeating the first ones so copies placed 2 * width apart meet exactly; repeat draws
+	//(2 * repeat + 1)^2 of them around the simulated patch. Change periodic through resize().
+	bool periodic = false;
+	int repeat = 0;
+	int vertices() const { return periodic ? n + 1 : n; }
+	float heightAt(int i, int j) const;
+	glm::vec2 wrapOffset(glm::vec2 position) const;
+	float separation(glm::vec2 a, glm::vec2 b) const;
+
+	//Radius bands. Particles of at least bandRadius go into coarse bands, band k holding radii from
+	//bandRadius * 2^(k-1), evaluated on a grid 2^k times coarser with the same eta() window so their
+	//reach grows with their size. Only the finest band is kept in cellMap. Not used when periodic.
+	//Change bands through resize().
+	int bands = 1;
+	float bandRadius = 12;
+	std::vector<waveBand> coarseBands; //bands 1 .. bands - 1
+	int bandOf(const waveParticle& p) const;
+	int bandReach(int band) const;
+	void evaluateBands();
+	float bandHeight(int i, int j) const;
+
+	//Surface queries for gameplay code (buoyancy, collision), safe to call from any thread while
+	//the water ticks. Positions are in the water's model space with y ignored. bilinear samples the
+	//latest height field, exact sums the particles around each point through the cell index.
+	enum queryMode { bilinear, exact };
+	void query(const glm::vec3* positions, size_t count, waterSample* out, queryMode mode = bilinear) const;
+	void queryBilinear(const glm::vec3* positions, size_t count, waterSample* out) const;
+	void queryExact(const glm::vec3* positions, size_t count, waterSample* out) const;
+	mutable std::shared_mutex stateMutex; //held exclusively by tick() and setHeights(), shared by queries
+	std::vector<float> lastHeightMap; //heights before the last update, for the surface velocity
+
+	//View dependent surface (CDLOD). The heightMap is mirrored into a float texture, tile by tile like
+	//the mesh, and every frame a quadtree over the water picks square patches whose grid cells cover
+	//about lodPixels pixels on screen, down to one simulation cell, so the triangle count follows the
+	//screen rather than n. All patches are the same lodPatch x lodPatch grid, drawn instanced and
+	//displaced from the texture in lodShader. Towards the end of its range a patch morphs into its
+	//parent's grid, so levels meet without cracks and switch without popping. Off, mesh is drawn.
+	struct lodInstance {
+		glm::vec4 patch; //origin x, origin z, size, unused
+		glm::vec2 morph; //distance where the morph starts, 1 / length of the morph
+	};
+	bool lod = true;
+	float lodPixels = 4;
+	const static int lodPatch = 16;
+	shader_program lodShader;
+	//uniforms drawLod() sets on lodShader
+	shader_uniform lodColor{ "uColor" }, lodAmbient{ "ambientStrength" }, lodSpecular{ "specularStrength" }, lodModel{ "uModelMatrix" };
+	shader_uniform lodCamera{ "uCamera" }, lodPatchSize{ "uPatchSize" }, lodTexScale{ "uTexScale" }, lodTexOffset{ "uTexOffset" };
+	shader_uniform lodCellSize{ "uCellSize" }, lodHeightMap{ "uHeightMap" };
+	GLuint heightTexture = 0;
+	cgra::gl_mesh lodGrid; //one patch, grid coordinates in x and z
+	GLuint lodInstanceBuffer = 0;
+	size_t lodInstanceCapacity = 0;
+	std::vector<lodInstance> lodInstances;
+	int lodTriangles = 0; //drawn by the last frame
+	void invalidateSurface();
+	void releaseGL();
+	void updateHeightTexture();
+	void selectPatches(glm::vec3 camera, float pixelScale, const cgra::frustum& clip);
+	void drawLod(const glm::mat4& view, const glm::mat4 proj, const cgra::frustum& clip);
+
+	//Binary checkpoint of the full simulation state (particles, fronts, rng and timers).
+	//Queued wave events are not part of the checkpoint.
+	void saveState(const std::string& filename);
+	void loadState(const std::string& filename);
 };
 
 water_plane water;
@@ -66,17 +303,53 @@ water_plane water;
 /*
 * Draws Mesh
 */
-void water_plane::draw(const glm::mat4& view, const glm::mat4 proj) {
-	mat4 modelview = view * modelTransform;
+void water_plane::draw(const glm::mat4& view, const glm::mat4 proj, const cgra::frustum& clip) {
+	if (lod) {
+		drawLod(view, proj, clip);
+		return;
+	}
 
-	glUseProgram(shader); // load shader and variables
-	glUniformMatrix4fv(glGetUniformLocation(shader, "uProjectionMatrix"), 1, false, value_ptr(proj));
-	glUniformMatrix4fv(glGetUniformLocation(shader, "uModelViewMatrix"), 1, false, value_ptr(modelview));
-	glUniform4fv(glGetUniformLocation(shader, "uColor"), 1, value_ptr(vec4(this->wcolor, 0.3)));
-	glUniform1f(glGetUniformLocation(shader, "ambientStrength"), 0.9);
-	glUniform1f(glGetUniformLocation(shader, "specularStrength"), 0.5);
+	shader.use(); // load shader and variables, the camera comes from FrameData
+	shader.set_uniform(uColor, vec4(this->wcolor, 0.3));
+	shader.set_uniform(uAmbient, 0.9f);
+	shader.set_uniform(uSpecular, 0.5f);
 
-	mesh.draw(); // draw
+	if (mesh.vao == 0) return;
+	cgra::frustum local = clip.transformed(modelTransform);
+	vector<GLsizei> counts;
+	vector<const void*> starts;
+	culledTiles = 0;
+	glBindVertexArray(mesh.vao);
+	int copies = periodic ? repeat : 0;
+	for (int a = -copies; a <= copies; a++) {
+		for (int b = -copies; b <= copies; b++) {
+			//visible tiles that follow each other in the index buffer are drawn as one range
+			vec3 offset = vec3(b * 2 * width, 0, a * 2 * width);
+			counts.clear();
+			starts.clear();
+			GLint end = -1;
+			for (int t = 0; t < tiles * tiles; t++) {
+				vec3 lo, hi;
+				tileBounds(t, lo, hi);
+				if (!local.intersects(lo + offset, hi + offset)) {
+					culledTiles++;
+					continue;
+				}
+				GLsizei count = tileFirstIndex[t + 1] - tileFirstIndex[t];
+				if (count == 0) continue;
+				if (tileFirstIndex[t] == end) counts.back() += count;
+				else {
+					counts.push_back(count);
+					starts.push_back((const void*)(tileFirstIndex[t] * sizeof(GLuint)));
+				}
+				end = tileFirstIndex[t + 1];
+			}
+			if (counts.empty()) continue;
+			shader.set_uniform(uModel, translate(modelTransform, offset));
+			glMultiDrawElements(mesh.mode, counts.data(), GL_UNSIGNED_INT, starts.data(), GLsizei(counts.size()));
+		}
+	}
+	glBindVertexArray(0);
 }
 
 /*
@@ -88,39 +361,33 @@ mesh_builder water_plane::createSurface() {
 	vector<vec3> normals;
 	vector<unsigned int> indices;
 	vector<vec2> uvs;
-	int x = 0;
-	vec3 normal = vec3(0, 1, 0);
-	for (int i = 0; i <= n-1; i++) {
-		for (int j = 0; j <= n-1; j++) {
-			int hi = i;
-			int hj = j;
-			if (i == n) {
-				hi = n - 1;
-			}
-			if (j == n) {
-				hj = n - 1;
-			}
-			positions.push_back(vec3((j * step - width), heightMap[hi][hj], (i * step - width)));
-			if (hi > 0 && hi < n - 1) {
-				if (hj > 0 && hj < n - 1) {
-					normal = normalize(vec3(heightMap[hi][hj - 1] - heightMap[hi][hj + 1], 1, heightMap[hi - 1][hj] - heightMap[hi + 1][hj]));
-				}
-			}
-
-			normals.push_back(normal);
+	int m = vertices();
+	for (int i = 0; i <= m-1; i++) {
+		for (int j = 0; j <= m-1; j++) {
+			positions.push_back(vec3((j * step - width), heightAt(i, j), (i * step - width)));
+			normals.push_back(surfaceNormal(i, j));
 		}
 	}
-	for (int row = 0; row < n-1; row++) {
-		for (int col = 0; col < n-1; col++) {
-			indices.push_back(n * row + col);
-			indices.push_back(n * row + col + n);
-			indices.push_back(n * row + col + n + 1);
+	//cells are emitted tile by tile so a tile can be culled as one range of indices
+	tileFirstIndex.assign(tiles * tiles + 1, 0);
+	for (int t = 0; t < tiles * tiles; t++) {
+		int ti = (t / tiles) * tileSize;
+		int tj = (t % tiles) * tileSize;
+		tileFirstIndex[t] = indices.size();
+		updateTileHeights(t);
+		for (int row = ti; row < std::min(ti + tileSize, m - 1); row++) {
+			for (int col = tj; col < std::min(tj + tileSize, m - 1); col++) {
+				indices.push_back(m * row + col);
+				indices.push_back(m * row + col + m);
+				indices.push_back(m * row + col + m + 1);
 
-			indices.push_back(n * row + col);
-			indices.push_back(n * row + col + n + 1);
-			indices.push_back(n * row + col + 1);
+				indices.push_back(m * row + col);
+				indices.push_back(m * row + col + m + 1);
+				indices.push_back(m * row + col + 1);
+			}
 		}
 	}
+	tileFirstIndex[tiles * tiles] = indices.size();
 	uvs.resize(positions.size(), vec3(0));
 	mesh_builder mb;
 	mb.indices = indices;
@@ -138,17 +405,16 @@ mesh_builder water_plane::createSurface() {
 /*
 * VISUALIZATION METHOD FOR WATER
 */
-void water_plane::visualize(const glm::mat4& view, const glm::mat4 proj) {
+void water_plane::visualize(const glm::mat4& /*view*/, const glm::mat4 /*proj*/) {
 	for (int i = 0; i < waveFronts.size(); i++) {
-		for (int j = 0; j < waveFronts[i].size(); j++) {
-			waveParticle particle = waveFronts[i][j];
-			mat4 pos = translate(view, vec3(particle.position.y, 0, particle.position.x));
+		for (int j = 0; j < waveFronts[i].ids.size(); j++) {
+			const waveParticle& particle = particles[waveFronts[i].ids[j]];
+			mat4 pos = translate(mat4(1), vec3(particle.position.y, 0, particle.position.x));
 			pos = scale(pos, vec3(0.5));
-			glUniformMatrix4fv(glGetUniformLocation(shader, "uModelViewMatrix"), 1, false, value_ptr(pos));
-			glUniform4fv(glGetUniformLocation(shader, "uColor"), 1, value_ptr(vec4(0, 1, 0,1)));
-			drawSphere();
+			queueSphere(pos, vec4(0, 1, 0, 1));
 		}
 	}
+	flushPrimitives();
 }
 
 /*
@@ -159,79 +425,563 @@ void water_plane::simulate() {
 	float elapsedMs = double(currentTime - lastTick) / CLOCKS_PER_SEC;
 	if (elapsedMs > rate) {
 		lastTick = currentTime;
-		iterate();
-		generateWaveParticles();
-		getHMap();
-		mesh = createSurface().build();
+		tick();
+		updateSurface();
 	}
 	if (playing) {
 		float waveTime = double(currentTime - lastWave) / CLOCKS_PER_SEC;
 		if (waveTime > waveRate/roughness) {
 			lastTick = currentTime;
-			water.randWave();
+			randWave();
 			lastWave = currentTime;
 		}
 	}
 }
 
 /*
-Moves the particles around and calculates which cell they belong to.
+Advances the simulation by one step. Only touches CPU data, the mesh is updated separately.
+*/
+void water_plane::tick() {
+	std::unique_lock<std::shared_mutex> lock(stateMutex);
+	drainEvents();
+	iterate();
+	generateWaveParticles();
+	lastHeightMap = heightMap;
+	getHMap();
+}
+
+/*
+Sets the grid resolution, reallocating the height field, cells and tiles and rebinning live particles.
+*/
+void water_plane::resize(int size) {
+	n = size;
+	heightMap.assign(n * n, baseHeight);
+	cellMap.assign(n * n, std::vector<int>());
+	tiles = (n + tileSize - 1) / tileSize;
+	sortCellsMorton(n, cellOrder);
+	coarseBands.assign(std::max(bands - 1, 0), waveBand());
+	for (int k = 0; k < coarseBands.size(); k++) {
+		coarseBands[k].scale = 2 << k;
+		coarseBands[k].size = (n + coarseBands[k].scale - 1) / coarseBands[k].scale;
+	}
+	//Everything starts active so the first tick flattens the whole grid to baseHeight.
+	activeTiles.assign(tiles * tiles, true);
+	lastActiveTiles.assign(tiles * tiles, false);
+	dirtyTiles.assign(tiles * tiles, false);
+	tileHeights.assign(tiles * tiles, vec2(baseHeight));
+	for (auto& wf : waveFronts) {
+		for (int id : wf.ids) {
+			particles[id].cell = -1;
+			int c = cellOf(particles[id].position);
+			if (c >= 0 && bandOf(particles[id]) == 0) bin(id, c);
+		}
+	}
+	invalidateSurface();
+}
+
+/*
+Moves the particles around and rebins the ones that crossed into another cell.
+The fronts are flattened and advected in chunks across threads; each thread keeps its own
+list of movers, deaths and touched tiles which are merged once the parallel pass is done.
 */
 void water_plane::iterate() {
-	std::vector<waveParticle> cM[n][n];
-	vector<vector<waveParticle>> WF2;
+	lastActiveTiles.swap(activeTiles);
+	std::fill(activeTiles.begin(), activeTiles.end(), false);
+
+	vector<int> offsets(waveFronts.size() + 1, 0);
+	for (int i = 0; i < waveFronts.size(); i++) {
+		offsets[i + 1] = offsets[i] + waveFronts[i].ids.size();
+	}
+	int total = offsets.back();
+	vector<int> ids(total);
+	vector<int> cells(total);
 	for (int i = 0; i < waveFronts.size(); i++) {
-		vector<waveParticle> wf;
-		for (int a = 0; a < waveFronts[i].size(); a++) {
-			auto part = waveFronts[i][a];
+		std::copy(waveFronts[i].ids.begin(), waveFronts[i].ids.end(), ids.begin() + offsets[i]);
+	}
+
+	int threads = 1;
+#ifdef CGRA_HAVE_OPENMP
+	threads = omp_get_max_threads();
+#endif
+	vector<vector<int>> moved(threads);
+	vector<vector<int>> dead(threads);
+	vector<vector<bool>> masks(threads, vector<bool>(tiles * tiles, false));
+
+	#pragma omp parallel
+	{
+		int t = 0;
+#ifdef CGRA_HAVE_OPENMP
+		t = omp_get_thread_num();
+#endif
+		#pragma omp for schedule(dynamic, 256)
+		for (int k = 0; k < total; k++) {
+			waveParticle& part = particles[ids[k]];
 			part.position += part.direction * part.speed;
-			if (part.position.x < width && part.position.y < width && part.position.x > -width && part.position.y > -width && part.amplitude > threshold) {
+			if (periodic) {
+				vec2 shift = wrapOffset(part.position);
+				part.position += shift;
+				part.origin += shift;
+			}
+			int c = cellOf(part.position);
+			if (c >= 0 && part.amplitude > threshold) {
 				part.amplitude -= damping;
-				float stepsize = 2 * width / n;
-				int j = (int)(((part.position.x + width) / (2 * width)) * n);
-				int k = (int)(((part.position.y + width) / (2 * width)) * n);
-				wf.push_back(part);
-				cM[j][k].push_back(part);
+				int band = bandOf(part);
+				if (band == 0 && c != part.cell) {
+					moved[t].push_back(k);
+				}
+				markTiles(c / n, c % n, masks[t], bandReach(band));
+			}
+			else {
+				dead[t].push_back(k);
+				c = -1;
 			}
+			cells[k] = c;
+		}
+	}
+
+	//merge the per-thread move lists into one array by prefix sum of their sizes
+	vector<int> moveOffsets(threads + 1, 0);
+	for (int t = 0; t < threads; t++) {
+		moveOffsets[t + 1] = moveOffsets[t] + moved[t].size();
+	}
+	vector<int> moves(moveOffsets.back());
+	#pragma omp parallel for
+	for (int t = 0; t < threads; t++) {
+		std::copy(moved[t].begin(), moved[t].end(), moves.begin() + moveOffsets[t]);
+	}
+
+	for (int k : moves) {
+		unbin(ids[k]);
+		bin(ids[k], cells[k]);
+	}
+	for (int t = 0; t < threads; t++) {
+		for (int k : dead[t]) {
+			killParticle(ids[k]);
 		}
-		if (wf.size() > 0) {
-			WF2.push_back(wf);
+		for (int i = 0; i < tiles * tiles; i++) {
+			if (masks[t][i]) activeTiles[i] = true;
 		}
 	}
-	waveFronts = WF2;
 
-	for (int i = 0; i < n; i++) {
-		for (int j = 0; j < n; j++) {
-			cellMap[i][j] = cM[i][j];
+	vector<waveFront> WF2(waveFronts.size());
+	#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < waveFronts.size(); i++) {
+		WF2[i].closed = waveFronts[i].closed;
+		for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+			if (cells[k] >= 0) WF2[i].ids.push_back(ids[k]);
 		}
 	}
+	WF2.erase(std::remove_if(WF2.begin(), WF2.end(), [](const waveFront& wf) { return wf.ids.empty(); }), WF2.end());
+	waveFronts.swap(WF2);
+
+	if (++ticks % compactRate == 0) {
+		compact();
+	}
 }
 
 /*
 Finds the height of every vertex in the mesh.
+Tiles with no particles nearby this tick or last are already flat and are skipped,
+tiles that just went calm are reset to the base height once.
 */
 void water_plane::getHMap() {
-	for (int i = 0; i < n; i++) {
-		for (int j = 0; j < n; j++) {
-			float stepSize = 2 * width / n;
-			glm::vec2 x = vec2(i, j);
-			heightMap[i][j] = baseHeight + eta(x);
+	evaluateBands();
+	for (int t = 0; t < tiles * tiles; t++) {
+		dirtyTiles[t] = activeTiles[t] || lastActiveTiles[t];
+	}
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < tiles * tiles; t++) {
+		if (!dirtyTiles[t]) continue;
+
+		int ti = (t / tiles) * tileSize;
+		int tj = (t % tiles) * tileSize;
+		for (int i = ti; i < std::min(ti + tileSize, n); i++) {
+			for (int j = tj; j < std::min(tj + tileSize, n); j++) {
+				heightMap[i * n + j] = activeTiles[t] ? baseHeight + eta(vec2(i, j)) + bandHeight(i, j) : baseHeight;
+			}
 		}
 	}
 }
 
 /*
-Sum of displacements of particles
+Marks every tile whose vertices can see cell (j, k) through the eta() lookup window.
+*/
+void water_plane::markTiles(int j, int k, std::vector<bool>& mask, int reach) {
+	if (reach <= 0) reach = adjacent;
+	if (periodic) {
+		//walk the window tile by tile in unwrapped cells, wrapping each tile index
+		for (int a = j - reach; a <= j + reach; a = a - (a % n + n) % n + std::min(((a % n + n) % n / tileSize + 1) * tileSize, n)) {
+			for (int b = k - reach; b <= k + reach; b = b - (b % n + n) % n + std::min(((b % n + n) % n / tileSize + 1) * tileSize, n)) {
+				mask[((a % n + n) % n / tileSize) * tiles + (b % n + n) % n / tileSize] = true;
+			}
+		}
+		return;
+	}
+	int i0 = std::max(j - reach, 0) / tileSize;
+	int i1 = std::min(j + reach, n - 1) / tileSize;
+	int j0 = std::max(k - reach, 0) / tileSize;
+	int j1 = std::min(k + reach, n - 1) / tileSize;
+	for (int a = i0; a <= i1; a++) {
+		for (int b = j0; b <= j1; b++) {
+			mask[a * tiles + b] = true;
+		}
+	}
+}
+
+/*
+Mesh rows (or columns) to refresh for a tile starting at row start: the tile grown by one vertex,
+wrapped in a periodic domain, where row 0 is also repeated as row n.
+*/
+void water_plane::tileVertices(int start, std::vector<int>& out) {
+	out.clear();
+	int end = std::min(start + tileSize, n) + 1;
+	if (!periodic) {
+		for (int v = std::max(start - 1, 0); v < std::min(end, n); v++) out.push_back(v);
+		return;
+	}
+	for (int v = start - 1; v < end; v++) {
+		int w = (v % n + n) % n;
+		out.push_back(w);
+		if (w == 0) out.push_back(n);
+	}
+	std::sort(out.begin(), out.end());
+	out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+/*
+Height range of the vertices tile t owns, kept for culling whenever the tile is re-uploaded.
+*/
+void water_plane::updateTileHeights(int t) {
+	int ti = (t / tiles) * tileSize;
+	int tj = (t % tiles) * tileSize;
+	vec2 range(heightMap[ti * n + tj]);
+	for (int i = ti; i < std::min(ti + tileSize, n); i++) {
+		for (int j = tj; j < std::min(tj + tileSize, n); j++) {
+			range = vec2(std::min(range.x, heightMap[i * n + j]), std::max(range.y, heightMap[i * n + j]));
+		}
+	}
+	tileHeights[t] = range;
+}
+
+/*
+Model space box around the mesh cells of tile t. The cells also reach the first row and column
+of vertices of the next tiles (wrapping when periodic), so their height ranges are included.
+*/
+void water_plane::tileBounds(int t, glm::vec3& lo, glm::vec3& hi) const {
+	float step = (2 * width) / n;
+	int a = t / tiles;
+	int b = t % tiles;
+	int last = vertices() - 1;
+	vec2 range = tileHeights[t];
+	for (int c = 1; c < 4; c++) {
+		int na = a + (c & 1);
+		int nb = b + (c >> 1);
+		if (periodic) {
+			na %= tiles;
+			nb %= tiles;
+		}
+		else if (na >= tiles || nb >= tiles) continue;
+		vec2 h = tileHeights[na * tiles + nb];
+		range = vec2(std::min(range.x, h.x), std::max(range.y, h.y));
+	}
+	lo = vec3(b * tileSize * step - width, range.x, a * tileSize * step - width);
+	hi = vec3(std::min((b + 1) * tileSize, last) * step - width, range.y, std::min((a + 1) * tileSize, last) * step - width);
+}
+
+/*
+Replaces the heightMap with externally computed heights (n x n, row major), marking the
+tiles that changed as dirty so updateSurface() only re-uploads those.
+Every tile is marked active, so once the simulation takes over again (playback stopped or
+failed) its first tick rewrites the whole grid instead of leaving calm tiles at these heights.
+*/
+void water_plane::setHeights(const float* heights) {
+	std::unique_lock<std::shared_mutex> lock(stateMutex);
+	lastHeightMap = heightMap;
+	std::fill(activeTiles.begin(), activeTiles.end(), true);
+	for (int t = 0; t < tiles * tiles; t++) {
+		int ti = (t / tiles) * tileSize;
+		int tj = (t % tiles) * tileSize;
+		bool changed = false;
+		for (int i = ti; i < std::min(ti + tileSize, n); i++) {
+			for (int j = tj; j < std::min(tj + tileSize, n); j++) {
+				changed = changed || heightMap[i * n + j] != heights[i * n + j];
+				heightMap[i * n + j] = heights[i * n + j];
+			}
+		}
+		dirtyTiles[t] = changed;
+	}
+}
+
+/*
+Normal of the surface at a vertex from central differences of the heightMap.
+*/
+vec3 water_plane::surfaceNormal(int i, int j) {
+	if (periodic) {
+		return normalize(vec3(heightAt(i, j - 1) - heightAt(i, j + 1), 1, heightAt(i - 1, j) - heightAt(i + 1, j)));
+	}
+	if (i <= 0 || i >= n - 1 || j <= 0 || j >= n - 1) return vec3(0, 1, 0);
+	return normalize(vec3(heightMap[i * n + j - 1] - heightMap[i * n + j + 1], 1, heightMap[(i - 1) * n + j] - heightMap[(i + 1) * n + j]));
+}
+
+/*
+Re-uploads the vertices of dirty tiles into the existing mesh instead of rebuilding it.
+Tiles are grown by one vertex so the normals along their edges are refreshed as well.
+*/
+void water_plane::updateSurface() {
+	if (lod) {
+		updateHeightTexture();
+		return;
+	}
+	if (mesh.vbo == 0) {
+		mesh = createSurface().build("water");
+		return;
+	}
+	float step = (2 * width) / n;
+	int m = vertices();
+	vector<int> rows;
+	vector<int> cols;
+	vector<mesh_vertex> row;
+	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+	for (int t = 0; t < tiles * tiles; t++) {
+		if (!dirtyTiles[t]) continue;
+
+		updateTileHeights(t);
+		tileVertices((t / tiles) * tileSize, rows);
+		tileVertices((t % tiles) * tileSize, cols);
+		for (int i : rows) {
+			//one upload per contiguous run of columns, runs only break at a periodic seam
+			for (int a = 0; a < cols.size();) {
+				int b = a;
+				row.clear();
+				while (b < cols.size() && cols[b] == cols[a] + (b - a)) {
+					int j = cols[b++];
+					row.push_back(mesh_vertex{ vec3((j * step - width), heightAt(i, j), (i * step - width)), surfaceNormal(i, j), vec2(0) });
+				}
+				glBufferSubData(GL_ARRAY_BUFFER, (i * m + cols[a]) * sizeof(mesh_vertex), row.size() * sizeof(mesh_vertex), row.data());
+				a = b;
+			}
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*
+Drops the uploaded surface (mesh and height texture) so the next update recreates it,
+for changes of size, periodicity or drawing mode.
+*/
+void water_plane::invalidateSurface() {
+	if (mesh.vao != 0) {
+		mesh.destroy();
+		mesh = gl_mesh();
+	}
+	if (heightTexture != 0) {
+		gpu_release(gpu_kind::texture, heightTexture);
+		glDeleteTextures(1, &heightTexture);
+		heightTexture = 0;
+	}
+}
+
+/*
+Deletes every GL object of the water, for shutdown. The shaders belong to the application.
+*/
+void water_plane::releaseGL() {
+	invalidateSurface();
+	lodGrid.destroy();
+	gpu_release(gpu_kind::buffer, lodInstanceBuffer);
+	glDeleteBuffers(1, &lodInstanceBuffer);
+	lodInstanceBuffer = 0;
+	lodInstanceCapacity = 0;
+}
+
+/*
+Mirrors the heightMap into heightTexture, creating it whole or re-uploading only the dirty tiles.
+Periodic water repeats the texture so sampling across the seam wraps like heightAt().
+*/
+void water_plane::updateHeightTexture() {
+	if (heightTexture == 0) {
+		glGenTextures(1, &heightTexture);
+		CGRA_GPU_TRACK(gpu_kind::texture, heightTexture, "water", "heights");
+		glBindTexture(GL_TEXTURE_2D, heightTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, n, n, 0, GL_RED, GL_FLOAT, heightMap.data());
+		gpu_resize(gpu_kind::texture, heightTexture, size_t(n) * n * sizeof(float));
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, periodic ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, periodic ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		for (int t = 0; t < tiles * tiles; t++) updateTileHeights(t);
+		return;
+	}
+	glBindTexture(GL_TEXTURE_2D, heightTexture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, n);
+	for (int t = 0; t < tiles * tiles; t++) {
+		if (!dirtyTiles[t]) continue;
+		updateTileHeights(t);
+		int ti = (t / tiles) * tileSize;
+		int tj = (t % tiles) * tileSize;
+		int rows = std::min(tileSize, n - ti);
+		int cols = std::min(tileSize, n - tj);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, tj, ti, cols, rows, GL_RED, GL_FLOAT, &heightMap[ti * n + tj]);
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/*
+Walks the quadtree over the water (all the copies when periodic) and fills lodInstances.
+Level k patches are kept within range[k] of the camera, where their cells cover lodPixels
+pixels; pixelScale is the viewport height in pixels over the view height at unit distance,
+divided by lodPixels. Each range is also at least the finer one plus the patch diagonal, so
+a patch only ever borders patches one level apart, and it morphs over its last quarter.
+*/
+void water_plane::selectPatches(glm::vec3 camera, float pixelScale, const cgra::frustum& clip) {
+	lodInstances.clear();
+	culledTiles = 0;
+	vec2 heights = tileHeights.empty() ? vec2(baseHeight) : tileHeights[0];
+	for (vec2 h : tileHeights) heights = vec2(std::min(heights.x, h.x), std::max(heights.y, h.y));
+	float step = (2 * width) / n;
+	int copies = periodic ? repeat : 0;
+	float rootSize = periodic ? 2 * width * (2 * copies + 1) : (vertices() - 1) * step;
+	vec2 rootOrigin = vec2(-width - 2 * width * copies);
+
+	//leaves have cells of about one simulation cell
+	int levels = 1;
+	while (levels < 16 && rootSize / (lodPatch << (levels - 1)) > step * 1.01f) levels++;
+	vector<float> range(levels);
+	for (int k = 0; k < levels; k++) {
+		float size = rootSize / (1 << (levels - 1 - k));
+		range[k] = pixelScale * size / lodPatch;
+		if (k > 0) range[k] = std::max(range[k], (range[k - 1] + 1.5f * size) / 0.75f);
+	}
+
+	struct node { vec2 origin; float size; int level; };
+	vector<node> stack{ node{ rootOrigin, rootSize, levels - 1 } };
+	while (!stack.empty()) {
+		node a = stack.back();
+		stack.pop_back();
+		vec2 lo = a.origin;
+		vec2 hi = a.origin + a.size;
+		if (!clip.intersects(vec3(lo.x, heights.x, lo.y), vec3(hi.x, heights.y, hi.y))) {
+			culledTiles++;
+			continue;
+		}
+		vec3 nearest = vec3(glm::clamp(camera.x, lo.x, hi.x), baseHeight, glm::clamp(camera.z, lo.y, hi.y));
+		if (a.level > 0 && distance(camera, nearest) < range[a.level - 1]) {
+			float half = a.size / 2;
+			for (int c = 0; c < 4; c++) {
+				stack.push_back(node{ a.origin + vec2(c % 2, c / 2) * half, half, a.level - 1 });
+			}
+			continue;
+		}
+		//the coarsest level has nothing to morph into
+		bool top = a.level == levels - 1;
+		float start = top ? 1e30f : 0.75f * range[a.level];
+		float morph = top ? 0 : 1 / (0.25f * range[a.level]);
+		lodInstances.push_back(lodInstance{ vec4(a.origin, a.size, 0), vec2(start, morph) });
+	}
+}
+
+/*
+Draws the surface as view dependent patches sampled from heightTexture.
+*/
+void water_plane::drawLod(const glm::mat4& view, const glm::mat4 proj, const cgra::frustum& clip) {
+	if (heightTexture == 0) updateHeightTexture();
+	if (lodGrid.vao == 0) {
+		mesh_builder mb;
+		for (int i = 0; i <= lodPatch; i++) {
+			for (int j = 0; j <= lodPatch; j++) {
+				mb.push_vertex(mesh_vertex{ vec3(j, 0, i), vec3(0, 1, 0), vec2(0) });
+			}
+		}
+		int m = lodPatch + 1;
+		for (int row = 0; row < lodPatch; row++) {
+			for (int col = 0; col < lodPatch; col++) {
+				mb.push_indices({ unsigned(m * row + col), unsigned(m * row + col + m), unsigned(m * row + col + m + 1) });
+				mb.push_indices({ unsigned(m * row + col), unsigned(m * row + col + m + 1), unsigned(m * row + col + 1) });
+			}
+		}
+		lodGrid = mb.build("water");
+
+		glGenBuffers(1, &lodInstanceBuffer);
+		CGRA_GPU_TRACK(gpu_kind::buffer, lodInstanceBuffer, "water", "patches");
+		glBindVertexArray(lodGrid.vao);
+		glBindBuffer(GL_ARRAY_BUFFER, lodInstanceBuffer);
+		glEnableVertexAttribArray(3);
+		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(lodInstance), (void*)(offsetof(lodInstance, patch)));
+		glVertexAttribDivisor(3, 1);
+		glEnableVertexAttribArray(4);
+		glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, sizeof(lodInstance), (void*)(offsetof(lodInstance, morph)));
+		glVertexAttribDivisor(4, 1);
+		glBindVertexArray(0);
+		lodInstanceCapacity = 0;
+	}
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	vec3 camera = vec3(inverse(view * modelTransform)[3]);
+	selectPatches(camera, viewport[3] * proj[1][1] / (2 * lodPixels), clip.transformed(modelTransform));
+	lodTriangles = int(lodInstances.size()) * lodPatch * lodPatch * 2;
+	if (lodInstances.empty()) return;
+
+	//grow the buffer geometrically, otherwise orphan it so the upload does not wait on the last draw
+	glBindBuffer(GL_ARRAY_BUFFER, lodInstanceBuffer);
+	if (lodInstances.size() > lodInstanceCapacity) lodInstanceCapacity = std::max(lodInstances.size(), 2 * lodInstanceCapacity);
+	glBufferData(GL_ARRAY_BUFFER, lodInstanceCapacity * sizeof(lodInstance), nullptr, GL_STREAM_DRAW);
+	gpu_resize(gpu_kind::buffer, lodInstanceBuffer, lodInstanceCapacity * sizeof(lodInstance));
+	glBufferSubData(GL_ARRAY_BUFFER, 0, lodInstances.size() * sizeof(lodInstance), lodInstances.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	float step = (2 * width) / n;
+	lodShader.use(); // load shader and variables, the camera comes from FrameData
+	lodShader.set_uniform(lodColor, vec4(this->wcolor, 0.3));
+	lodShader.set_uniform(lodAmbient, 0.9f);
+	lodShader.set_uniform(lodSpecular, 0.5f);
+	lodShader.set_uniform(lodModel, modelTransform);
+	lodShader.set_uniform(lodCamera, camera);
+	lodShader.set_uniform(lodPatchSize, float(lodPatch));
+	lodShader.set_uniform(lodTexScale, 1 / (2 * width));
+	lodShader.set_uniform(lodTexOffset, vec2(0.5f + 0.5f / n));
+	lodShader.set_uniform(lodCellSize, step);
+	lodShader.set_uniform(lodHeightMap, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, heightTexture);
+
+	glBindVertexArray(lodGrid.vao);
+	glDrawElementsInstanced(lodGrid.mode, lodGrid.index_count, GL_UNSIGNED_INT, 0, GLsizei(lodInstances.size()));
+	glBindVertexArray(0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/*
+Sum of displacements of particles in the cells around x
 */
 float water_plane::eta(glm::vec2 x) {
 	float _sum = 0;
+	float stepSize = 2 * width / n;
+	vec2 x2 = vec2(-width, -width) + x * stepSize;
 
-	vector<waveParticle> neighbors = getAdjacent(x, n, adjacent);
-	for (int i = 0; i < neighbors.size(); i++) {
-		waveParticle p = neighbors[i];
-		float stepSize = 2 * width / n;
-		vec2 x2 = vec2(-width, -width) + x * stepSize;
-		_sum += p.displacement(x2);
+	int rad = adjacent;
+	if (periodic) {
+		//cells past the edge are read from the other side, with x moved by the period so distances are to the nearest image
+		for (int i = x.x - rad; i < x.x + rad; i++) {
+			int ci = (i % n + n) % n;
+			for (int j = x.y - rad; j < x.y + rad; j++) {
+				int cj = (j % n + n) % n;
+				vec2 image = x2 - vec2(i - ci, j - cj) * stepSize;
+				for (int id : cellMap[ci * n + cj]) {
+					_sum += particles[id].displacement(image);
+				}
+			}
+		}
+		return _sum;
+	}
+	for (int i = fmax(x.x - rad, 0); i < fmin(x.x + rad, n); i++) {
+		for (int j = fmax(x.y - rad, 0); j < fmin(x.y + rad, n); j++) {
+			for (int id : cellMap[i * n + j]) {
+				_sum += particles[id].displacement(x2);
+			}
+		}
 	}
 	return _sum;
 
@@ -240,7 +990,7 @@ float water_plane::eta(glm::vec2 x) {
 /*
 Rectangle function for waveform calculation
 */
-float waveParticle::rf(float x) {
+float waveParticle::rf(float x) const {
 	if (abs(x) < 0.5) return 1;
 	if (abs(x) < 0.6) return 0.5;
 	if (abs(x) < 0.8) return 0.2;
@@ -260,35 +1010,649 @@ float waveParticle::displacement(glm::vec2 x) {
 }
 
 
-//Gets a simple square area around the point of size radius.
-vector<waveParticle> water_plane::getAdjacent(vec2 p, int n, int rad) {
-	vector<waveParticle> ne = vector<waveParticle>();
+/*
+Flattened cell index for a position, or -1 if it is outside the water.
+*/
+int water_plane::cellOf(glm::vec2 position) const {
+	if (periodic) {
+		int j = (int)floor(((position.x + width) / (2 * width)) * n);
+		int k = (int)floor(((position.y + width) / (2 * width)) * n);
+		return ((j % n + n) % n) * n + (k % n + n) % n;
+	}
+	if (!(position.x < width && position.y < width && position.x > -width && position.y > -width)) return -1;
+	int j = std::min((int)(((position.x + width) / (2 * width)) * n), n - 1);
+	int k = std::min((int)(((position.y + width) / (2 * width)) * n), n - 1);
+	return j * n + k;
+}
 
-	for (int i = fmax(p.x - rad, 0); i < fmin(p.x + rad, n); i++) {
-		for (int j = fmax(p.y - rad, 0); j < fmin(p.y + rad, n); j++) {
-			for (auto p : cellMap[i][j]) {
-				ne.push_back(p);
+/*
+Height of mesh vertex (i, j). In a periodic domain the indices wrap, so row and column n repeat 0.
+*/
+float water_plane::heightAt(int i, int j) const {
+	if (periodic) return heightMap[((i % n + n) % n) * n + (j % n + n) % n];
+	return heightMap[i * n + j];
+}
+
+/*
+Multiple of the period that brings a position back into the domain, zero unless periodic.
+*/
+vec2 water_plane::wrapOffset(glm::vec2 position) const {
+	if (!periodic) return vec2(0);
+	float period = 2 * width;
+	return -period * floor((position + width) / period);
+}
+
+/*
+Distance between two positions, to the nearest image of b in a periodic domain.
+*/
+float water_plane::separation(glm::vec2 a, glm::vec2 b) const {
+	vec2 d = b - a;
+	if (periodic) d -= 2 * width * round(d / (2 * width));
+	return length(d);
+}
+
+/*
+Radius band of a particle, 0 for the finest band evaluated on the water's own grid.
+*/
+int water_plane::bandOf(const waveParticle& p) const {
+	if (bands <= 1 || periodic) return 0;
+	int band = 0;
+	float edge = bandRadius;
+	while (band + 1 < bands && p.radius >= edge) {
+		band++;
+		edge *= 2;
+	}
+	return band;
+}
+
+/*
+Cells of the water a particle of the band can reach, including the bilinear upsampling, 0 for the eta() window.
+*/
+int water_plane::bandReach(int band) const {
+	if (band == 0) return 0;
+	int scale = coarseBands[band - 1].scale;
+	return (int(adjacent) + 1) * scale;
+}
+
+/*
+Bins the particles of every coarse band into its grid and evaluates the displacement at
+the band vertices that have particles in reach, leaving the others at zero.
+*/
+void water_plane::evaluateBands() {
+	if (coarseBands.empty()) return;
+	vector<vector<std::pair<int, int>>> binned(coarseBands.size());
+	for (auto& wf : waveFronts) {
+		for (int id : wf.ids) {
+			int band = bandOf(particles[id]);
+			int c = cellOf(particles[id].position);
+			if (band == 0 || c < 0) continue;
+			const waveBand& b = coarseBands[band - 1];
+			binned[band - 1].push_back(std::make_pair((c / n / b.scale) * b.size + (c % n) / b.scale, id));
+		}
+	}
+
+	int rad = adjacent;
+	float stepSize = 2 * width / n;
+	for (int k = 0; k < coarseBands.size(); k++) {
+		waveBand& b = coarseBands[k];
+		int m = b.size + 1;
+		b.ids.resize(binned[k].size());
+		if (b.ids.empty()) continue;
+
+		//counting sort by band cell
+		b.start.assign(b.size * b.size + 1, 0);
+		for (auto& e : binned[k]) b.start[e.first + 1]++;
+		for (int c = 0; c < b.size * b.size; c++) b.start[c + 1] += b.start[c];
+		vector<int> fill(b.start.begin(), b.start.end() - 1);
+		for (auto& e : binned[k]) b.ids[fill[e.first]++] = e.second;
+
+		//vertex v reads cells [v - rad, v + rad), so cell c is seen from vertices (c - rad, c + rad]
+		b.live.assign(m * m, false);
+		for (int c = 0; c < b.size * b.size; c++) {
+			if (b.start[c] == b.start[c + 1]) continue;
+			int ci = c / b.size, cj = c % b.size;
+			for (int vi = std::max(ci - rad + 1, 0); vi <= std::min(ci + rad, b.size); vi++) {
+				for (int vj = std::max(cj - rad + 1, 0); vj <= std::min(cj + rad, b.size); vj++) {
+					b.live[vi * m + vj] = true;
+				}
+			}
+		}
+
+		b.heights.assign(m * m, 0);
+		#pragma omp parallel for schedule(dynamic)
+		for (int vi = 0; vi < m; vi++) {
+			for (int vj = 0; vj < m; vj++) {
+				if (!b.live[vi * m + vj]) continue;
+				vec2 x = vec2(-width, -width) + vec2(vi, vj) * (b.scale * stepSize);
+				float sum = 0;
+				for (int ci = std::max(vi - rad, 0); ci < std::min(vi + rad, b.size); ci++) {
+					for (int cj = std::max(vj - rad, 0); cj < std::min(vj + rad, b.size); cj++) {
+						int c = ci * b.size + cj;
+						for (int e = b.start[c]; e < b.start[c + 1]; e++) {
+							sum += particles[b.ids[e]].displacement(x);
+						}
+					}
+				}
+				b.heights[vi * m + vj] = sum;
+			}
+		}
+	}
+}
+
+/*
+Sum of the coarse bands at water vertex (i, j), bilinearly upsampled from their grids.
+*/
+float water_plane::bandHeight(int i, int j) const {
+	float h = 0;
+	for (const waveBand& b : coarseBands) {
+		if (b.ids.empty()) continue;
+		int m = b.size + 1;
+		int bi = i / b.scale;
+		int bj = j / b.scale;
+		float fi = float(i % b.scale) / b.scale;
+		float fj = float(j % b.scale) / b.scale;
+		const float* v = &b.heights[bi * m + bj];
+		h += mix(mix(v[0], v[1], fj), mix(v[m], v[m + 1], fj), fi);
+	}
+	return h;
+}
+
+/*
+Adds a particle to the store, reusing a dead slot if there is one, and bins it.
+*/
+int water_plane::newParticle(const waveParticle& p) {
+	int id;
+	if (freeParticles.empty()) {
+		id = particles.size();
+		particles.push_back(p);
+	}
+	else {
+		id = freeParticles.back();
+		freeParticles.pop_back();
+		particles[id] = p;
+	}
+	particles[id].cell = -1;
+	vec2 shift = wrapOffset(p.position);
+	particles[id].position += shift;
+	particles[id].origin += shift;
+	int c = cellOf(particles[id].position);
+	if (c >= 0) {
+		int band = bandOf(particles[id]);
+		if (band == 0) bin(id, c);
+		markTiles(c / n, c % n, activeTiles, bandReach(band));
+	}
+	return id;
+}
+
+void water_plane::killParticle(int id) {
+	unbin(id);
+	freeParticles.push_back(id);
+}
+
+void water_plane::bin(int id, int c) {
+	std::vector<int>& cell = cellMap[c];
+	particles[id].cell = c;
+	particles[id].slot = cell.size();
+	cell.push_back(id);
+}
+
+/*
+Removes a particle from its cell by swapping the last entry into its slot.
+*/
+void water_plane::unbin(int id) {
+	waveParticle& p = particles[id];
+	if (p.cell < 0) return;
+	std::vector<int>& cell = cellMap[p.cell];
+	int last = cell.back();
+	cell[p.slot] = last;
+	particles[last].slot = p.slot;
+	cell.pop_back();
+	p.cell = -1;
+}
+
+/*
+Rebuilds the particle store in cell order so particles sharing a cell are contiguous,
+dropping dead slots and remapping the fronts and cells to the new indices.
+Particles keep their slots, so only their indices change.
+*/
+void water_plane::compact() {
+	vector<int> remap(particles.size(), -1);
+	vector<waveParticle> packed;
+	packed.reserve(particles.size() - freeParticles.size());
+	for (int c = 0; c < cellMap.size(); c++) {
+		for (int& id : cellMap[mortonOrder ? cellOrder[c] : c]) {
+			remap[id] = packed.size();
+			packed.push_back(particles[id]);
+			id = remap[id];
+		}
+	}
+	for (auto& wf : waveFronts) {
+		for (int& id : wf.ids) {
+			if (remap[id] < 0) {
+				remap[id] = packed.size();
+				packed.push_back(particles[id]);
+			}
+			id = remap[id];
+		}
+	}
+	particles.swap(packed);
+	freeParticles.clear();
+}
+
+/*
+Samples the surface at a batch of points. Takes the state lock shared, so any number of
+threads can query while tick() waits for them.
+*/
+void water_plane::query(const glm::vec3* positions, size_t count, waterSample* out, queryMode mode) const {
+	std::shared_lock<std::shared_mutex> lock(stateMutex);
+	if (mode == exact) queryExact(positions, count, out);
+	else queryBilinear(positions, count, out);
+}
+
+/*
+Bilinear interpolation of the height field, with the normal from the gradient of the same patch
+and the velocity from the change since the previous height field. Points are handled in blocks:
+the coordinate and blend loops are branch free so they vectorize, only the corner loads are gathers.
+*/
+void water_plane::queryBilinear(const glm::vec3* positions, size_t count, waterSample* out) const {
+	const int block = 64;
+	float step = 2 * width / n;
+	bool moving = lastHeightMap.size() == heightMap.size();
+	float fu[block], fv[block], h[4][block], last[4][block];
+	int corner[4][block];
+	for (size_t first = 0; first < count; first += block) {
+		int m = int(std::min<size_t>(block, count - first));
+
+		//grid rows follow model z and columns model x, as in createSurface()
+		for (int k = 0; k < m; k++) {
+			float u = (positions[first + k].z + width) / step;
+			float v = (positions[first + k].x + width) / step;
+			float i0 = floor(u);
+			float j0 = floor(v);
+			fu[k] = u - i0;
+			fv[k] = v - j0;
+			int a = int(i0), b = int(j0);
+			int a1, b1;
+			if (periodic) {
+				a = (a % n + n) % n;
+				b = (b % n + n) % n;
+				a1 = (a + 1) % n;
+				b1 = (b + 1) % n;
 			}
+			else {
+				//clamp to the edge of the water
+				fu[k] = a < 0 ? 0 : a >= n - 1 ? 1 : fu[k];
+				fv[k] = b < 0 ? 0 : b >= n - 1 ? 1 : fv[k];
+				a = std::min(std::max(a, 0), n - 2);
+				b = std::min(std::max(b, 0), n - 2);
+				a1 = a + 1;
+				b1 = b + 1;
+			}
+			corner[0][k] = a * n + b;
+			corner[1][k] = a * n + b1;
+			corner[2][k] = a1 * n + b;
+			corner[3][k] = a1 * n + b1;
+		}
+		for (int c = 0; c < 4; c++) {
+			for (int k = 0; k < m; k++) h[c][k] = heightMap[corner[c][k]];
+			for (int k = 0; k < m; k++) last[c][k] = moving ? lastHeightMap[corner[c][k]] : h[c][k];
+		}
+		for (int k = 0; k < m; k++) {
+			float top = h[0][k] + (h[1][k] - h[0][k]) * fv[k];
+			float bottom = h[2][k] + (h[3][k] - h[2][k]) * fv[k];
+			float height = top + (bottom - top) * fu[k];
+			float dz = (bottom - top) / step;
+			float dx = ((h[1][k] - h[0][k]) + ((h[3][k] - h[2][k]) - (h[1][k] - h[0][k])) * fu[k]) / step;
+			float lastTop = last[0][k] + (last[1][k] - last[0][k]) * fv[k];
+			float lastBottom = last[2][k] + (last[3][k] - last[2][k]) * fv[k];
+			float lastHeight = lastTop + (lastBottom - lastTop) * fu[k];
+
+			waterSample& sample = out[first + k];
+			sample.height = height;
+			sample.normal = normalize(vec3(-dx, 1, -dz));
+			sample.velocity = (height - lastHeight) / rate;
+		}
+	}
+}
+
+/*
+Evaluates the particles around every point directly, with the analytic gradient of their
+displacement for the normal and their motion for the velocity. Visits the same cells as eta()
+would from the grid vertex below each point, so at vertices it matches the height field.
+Parallel over the points for large batches.
+*/
+void water_plane::queryExact(const glm::vec3* positions, size_t count, waterSample* out) const {
+	float pi = 3.141592;
+	float step = 2 * width / n;
+	int rad = adjacent;
+
+	//adds one particle's displacement, its gradient and its rate of change at x
+	auto add = [&](const waveParticle& q, vec2 x, float& h, vec2& grad, float& dhdt) {
+		vec2 d = x - q.position;
+		float r = length(d);
+		float rect = q.rf(r / (2 * q.radius));
+		if (rect == 0) return;
+		h += (q.amplitude / 2) * (cosf(pi * r / q.radius) + 1) * rect;
+		if (r <= 0) return;
+		float slope = -(q.amplitude / 2) * (pi / q.radius) * sinf(pi * r / q.radius) * rect;
+		grad += slope * d / r;
+		dhdt -= slope * dot(d / r, q.direction * q.speed) / rate;
+	};
+
+	#pragma omp parallel for schedule(static) if (count > 256)
+	for (long long k = 0; k < (long long)count; k++) {
+		//model (x, z) is (y, x) in particle space, see createSurface()
+		vec2 x = vec2(positions[k].z, positions[k].x);
+		float h = 0, dhdt = 0;
+		vec2 grad(0);
+		int ci = int(floor((x.x + width) / step));
+		int cj = int(floor((x.y + width) / step));
+		for (int i = ci - rad; i < ci + rad; i++) {
+			for (int j = cj - rad; j < cj + rad; j++) {
+				int wi = i, wj = j;
+				if (periodic) {
+					wi = (i % n + n) % n;
+					wj = (j % n + n) % n;
+				}
+				else if (i < 0 || j < 0 || i >= n || j >= n) continue;
+				vec2 image = x - vec2(i - wi, j - wj) * step;
+				for (int id : cellMap[wi * n + wj]) add(particles[id], image, h, grad, dhdt);
+			}
+		}
+		for (const waveBand& b : coarseBands) {
+			if (b.ids.empty()) continue;
+			int bi = std::min(std::max(ci, 0), n - 1) / b.scale;
+			int bj = std::min(std::max(cj, 0), n - 1) / b.scale;
+			for (int i = std::max(bi - rad, 0); i < std::min(bi + rad, b.size); i++) {
+				for (int j = std::max(bj - rad, 0); j < std::min(bj + rad, b.size); j++) {
+					int c = i * b.size + j;
+					for (int e = b.start[c]; e < b.start[c + 1]; e++) add(particles[b.ids[e]], x, h, grad, dhdt);
+				}
+			}
+		}
+
+		waterSample& sample = out[k];
+		sample.height = baseHeight + h;
+		sample.normal = normalize(vec3(-grad.y, 1, -grad.x));
+		sample.velocity = dhdt;
+	}
+}
+
+namespace {
+	const char checkpointMagic[4] = { 'W', 'P', 'C', 'K' };
+	const uint32_t checkpointVersion = 3;
+
+	//Fixed size part of a checkpoint, followed by the rng state, the particle store,
+	//the free list, the fronts and the heightMap.
+	struct checkpointHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t particleSize; //sizeof(waveParticle) when written
+		int32_t n;
+		uint32_t particleCount;
+		uint32_t freeCount;
+		uint32_t frontCount;
+		uint32_t rngBytes;
+		int32_t ticks;
+		int32_t compactRate;
+		float width, threshold, baseHeight, baseAmp, waveRate, roughness, damping, adjacent, radius, speed, rate;
+		float sinceTick, sinceWave; //seconds since the last tick and wave, the clock itself is per process
+		uint32_t playing;
+		uint32_t periodic;
+		int32_t bands;
+		float bandRadius;
+	};
+}
+
+/*
+Writes the whole simulation state to a file, bulk copying the particle arrays.
+*/
+void water_plane::saveState(const std::string& filename) {
+	std::ofstream file(filename, std::ios::binary);
+	if (!file) {
+		std::cerr << "Error: Could not open " << filename << " for writing" << std::endl;
+		throw std::runtime_error("Error: Could not open " + filename + " for writing");
+	}
+
+	std::ostringstream rngState;
+	rngState << rng;
+	std::string rngText = rngState.str();
+
+	clock_t now = clock();
+	checkpointHeader h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, checkpointMagic, 4);
+	h.version = checkpointVersion;
+	h.particleSize = sizeof(waveParticle);
+	h.n = n;
+	h.particleCount = particles.size();
+	h.freeCount = freeParticles.size();
+	h.frontCount = waveFronts.size();
+	h.rngBytes = rngText.size();
+	h.ticks = ticks;
+	h.compactRate = compactRate;
+	h.width = width;
+	h.threshold = threshold;
+	h.baseHeight = baseHeight;
+	h.baseAmp = baseAmp;
+	h.waveRate = waveRate;
+	h.roughness = roughness;
+	h.damping = damping;
+	h.adjacent = adjacent;
+	h.radius = radius;
+	h.speed = speed;
+	h.rate = rate;
+	h.sinceTick = float(now - lastTick) / CLOCKS_PER_SEC;
+	h.sinceWave = float(now - lastWave) / CLOCKS_PER_SEC;
+	h.playing = playing;
+	h.periodic = periodic;
+	h.bands = bands;
+	h.bandRadius = bandRadius;
+
+	file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	file.write(rngText.data(), rngText.size());
+	file.write(reinterpret_cast<const char*>(particles.data()), particles.size() * sizeof(waveParticle));
+	file.write(reinterpret_cast<const char*>(freeParticles.data()), freeParticles.size() * sizeof(int));
+	for (const waveFront& wf : waveFronts) {
+		uint32_t info[2] = { uint32_t(wf.ids.size()), uint32_t(wf.closed) };
+		file.write(reinterpret_cast<const char*>(info), sizeof(info));
+		file.write(reinterpret_cast<const char*>(wf.ids.data()), wf.ids.size() * sizeof(int));
+	}
+	file.write(reinterpret_cast<const char*>(heightMap.data()), heightMap.size() * sizeof(float));
+	if (!file) throw std::runtime_error("Error: Failed to write " + filename);
+}
+
+/*
+Restores a state written by saveState(). The cells are rebuilt from the cell and slot
+stored in each particle, so particles keep their exact order inside every cell.
+Everything is checked against the file before the current state is touched; a checkpoint
+that does not describe a consistent state throws and leaves the water as it was.
+*/
+void water_plane::loadState(const std::string& filename) {
+	auto fail = [&](const std::string& what) {
+		std::cerr << "Error: " << what << " in water checkpoint " << filename << std::endl;
+		throw std::runtime_error("Error: " + what + " in water checkpoint " + filename);
+	};
+
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file) {
+		std::cerr << "Error: Could not open " << filename << std::endl;
+		throw std::runtime_error("Error: Could not open " + filename);
+	}
+	uint64_t fileBytes = uint64_t(file.tellg());
+	file.seekg(0);
+
+	checkpointHeader h;
+	file.read(reinterpret_cast<char*>(&h), sizeof(h));
+	if (!file || std::memcmp(h.magic, checkpointMagic, 4) != 0 || h.version != checkpointVersion || h.particleSize != sizeof(waveParticle)) {
+		std::cerr << "Error: " << filename << " is not a compatible water checkpoint" << std::endl;
+		throw std::runtime_error("Error: " + filename + " is not a compatible water checkpoint");
+	}
+
+	//n * n cells must fit in an int, and every count must fit in the bytes the file has,
+	//so nothing is allocated for data that is not there
+	if (h.n < 1 || h.n > 46340) fail("Invalid grid size");
+	if (h.compactRate < 1) fail("Invalid compaction rate");
+	if (h.bands < 1 || h.bands > 16) fail("Invalid band count");
+	if (h.freeCount > h.particleCount) fail("Invalid free list size");
+	uint64_t needed = sizeof(h) + uint64_t(h.rngBytes) + uint64_t(h.particleCount) * sizeof(waveParticle) + uint64_t(h.freeCount) * sizeof(int)
+		+ uint64_t(h.frontCount) * 2 * sizeof(uint32_t) + uint64_t(h.n) * uint64_t(h.n) * sizeof(float);
+	if (needed > fileBytes) fail("Truncated data");
+
+	std::string rngText(h.rngBytes, ' ');
+	file.read(&rngText[0], rngText.size());
+	std::vector<waveParticle> P(h.particleCount);
+	file.read(reinterpret_cast<char*>(P.data()), P.size() * sizeof(waveParticle));
+	std::vector<int> F(h.freeCount);
+	file.read(reinterpret_cast<char*>(F.data()), F.size() * sizeof(int));
+	std::vector<waveFront> WF(h.frontCount);
+	for (waveFront& wf : WF) {
+		uint32_t info[2];
+		file.read(reinterpret_cast<char*>(info), sizeof(info));
+		needed += uint64_t(info[0]) * sizeof(int);
+		if (!file || info[0] > h.particleCount || needed > fileBytes) fail("Truncated front");
+		wf.ids.resize(info[0]);
+		wf.closed = info[1] != 0;
+		file.read(reinterpret_cast<char*>(wf.ids.data()), wf.ids.size() * sizeof(int));
+	}
+	std::vector<float> H(size_t(h.n) * h.n);
+	file.read(reinterpret_cast<char*>(H.data()), H.size() * sizeof(float));
+	if (!file) fail("Truncated data");
+
+	//every particle is either in one front or free, never both or twice
+	std::vector<char> owned(P.size(), 0);
+	for (int id : F) {
+		if (id < 0 || id >= int(P.size()) || owned[id]++) fail("Invalid free particle id");
+		if (P[id].cell != -1) fail("Binned free particle");
+	}
+	for (const waveFront& wf : WF) {
+		for (int id : wf.ids) {
+			if (id < 0 || id >= int(P.size()) || owned[id]++) fail("Invalid front particle id");
 		}
 	}
-	return ne;
 
+	//cells are packed, so their slots must be exactly 0 .. size - 1 with each taken once
+	std::vector<std::vector<int>> C(size_t(h.n) * h.n);
+	for (const waveParticle& p : P) {
+		if (p.cell == -1) continue;
+		if (p.cell < 0 || p.cell >= int(C.size()) || p.slot < 0 || p.slot >= int(P.size())) fail("Invalid particle cell");
+		C[p.cell].resize(std::max<size_t>(C[p.cell].size(), p.slot + 1), -1);
+	}
+	for (int id = 0; id < int(P.size()); id++) {
+		if (P[id].cell == -1) continue;
+		int& entry = C[P[id].cell][P[id].slot];
+		if (entry != -1) fail("Particles sharing a cell slot");
+		entry = id;
+	}
+	for (const std::vector<int>& cell : C) {
+		if (std::find(cell.begin(), cell.end(), -1) != cell.end()) fail("Gap in a cell");
+	}
+
+	std::default_random_engine R;
+	std::istringstream rngState(rngText);
+	if (!(rngState >> R)) fail("Invalid random engine state");
+
+	std::unique_lock<std::shared_mutex> lock(stateMutex);
+	width = h.width;
+	threshold = h.threshold;
+	baseHeight = h.baseHeight;
+	baseAmp = h.baseAmp;
+	waveRate = h.waveRate;
+	roughness = h.roughness;
+	damping = h.damping;
+	adjacent = h.adjacent;
+	radius = h.radius;
+	speed = h.speed;
+	rate = h.rate;
+	ticks = h.ticks;
+	compactRate = h.compactRate;
+	playing = h.playing != 0;
+	periodic = h.periodic != 0;
+	bands = h.bands;
+	bandRadius = h.bandRadius;
+	rng = R;
+	clock_t now = clock();
+	lastTick = now - h.sinceTick * CLOCKS_PER_SEC;
+	lastWave = now - h.sinceWave * CLOCKS_PER_SEC;
+
+	//resize with no fronts so nothing is rebinned, then put the saved particles and cells in place
+	waveFronts.clear();
+	resize(h.n);
+	particles.swap(P);
+	freeParticles.swap(F);
+	waveFronts.swap(WF);
+	cellMap.swap(C);
+	heightMap.swap(H);
+}
+
+/*
+Queues a ring at a random point on the water, starting one grid step out like a drop.
+*/
+void water_plane::randWave(float waveRadius) {
+	std::uniform_real_distribution<float> dist(0, 2 * width);
+	float ri = dist(rng);
+	float rj = dist(rng);
+	waveEvent e;
+	e.kind = waveEvent::ring;
+	e.position = vec2(-width, -width) + vec2(ri, rj);
+	e.length = 2 * width / n;
+	e.radius = waveRadius;
+	addWave(std::move(e));
 }
 
-void water_plane::randWave() {
-	float ri = (((float)rand() / RAND_MAX) * (2 * width));
-	float rj = (((float)rand() / RAND_MAX) * (2 * width));
+/*
+Queues a wave to be added at the start of the next tick. Safe to call from any thread.
+*/
+void water_plane::addWave(waveEvent e) {
+	waveEvents.push(std::move(e));
+}
+
+/*
+Applies every queued wave event. Only called from the simulation thread.
+*/
+void water_plane::drainEvents() {
+	waveEvent e;
+	while (waveEvents.pop(e)) {
+		float amplitude = e.amplitude > 0 ? e.amplitude : baseAmp;
+		//the event's radius stands in for the plane's while it is applied
+		float planeRadius = radius;
+		if (e.radius > 0) radius = e.radius;
+		switch (e.kind) {
+		case waveEvent::drop:
+			spawnDrop(e.position, amplitude);
+			break;
+		case waveEvent::front:
+			spawnFront(e.position, e.direction, e.length, amplitude);
+			break;
+		case waveEvent::batch:
+			spawnBatch(e.particles, e.closed);
+			break;
+		//rings smaller than a particle start with the count they need at one particle radius
+		case waveEvent::ring:
+			emitRing(e.position, e.length, amplitude, radius);
+			break;
+		case waveEvent::arc:
+			emitArc(e.position, e.length, e.startAngle, e.endAngle, amplitude, radius);
+			break;
+		}
+		radius = planeRadius;
+	}
+}
+
+/*
+Adds a small ring of four particles moving out from p.
+*/
+void water_plane::spawnDrop(glm::vec2 p, float amplitude) {
 	float stepSize = 2 * width / n;
-	waveParticle p1, p2, p3, p4, p5, p6;
-	vec2 o = vec2(-width, -width);
+	waveParticle p1, p2, p3, p4;
 	p1.direction = normalize(vec2(0, 1));
 	p2.direction = normalize(vec2(1, 0));
 	p3.direction = normalize(vec2(0, -1));
 	p4.direction = normalize(vec2(-1, 0));
-	p1.position = o + vec2(ri, rj) + (p1.direction * stepSize);
-	p2.position = o + vec2(ri, rj) + (p2.direction * stepSize);
-	p3.position = o + vec2(ri, rj) + (p3.direction * stepSize);
-	p4.position = o + vec2(ri, rj) + (p4.direction * stepSize);
+	p1.position = p + (p1.direction * stepSize);
+	p2.position = p + (p2.direction * stepSize);
+	p3.position = p + (p3.direction * stepSize);
+	p4.position = p + (p4.direction * stepSize);
 	p1.dispAng = 0;
 	p2.dispAng = 180;
 	p3.dispAng = 90;
@@ -301,34 +1665,155 @@ void water_plane::randWave() {
 
 	for (int i = 0; i < wf.size(); i++) {
 		wf[i].origin = wf[i].position;
-		wf[i].amplitude = baseAmp;
+		wf[i].amplitude = amplitude;
+		wf[i].radius = radius;
+		wf[i].speed = speed;
+	}
+	spawnBatch(wf, true);
+}
+
+/*
+Adds a straight open front centred on p, perpendicular to dir and travelling along it.
+*/
+void water_plane::spawnFront(glm::vec2 p, glm::vec2 dir, float length, float amplitude) {
+	dir = normalize(dir);
+	vec2 side = vec2(-dir.y, dir.x) * (length / 2);
+	emitLine(p - side, p + side, dir, amplitude);
+}
+
+/*
+Adds the given particles as one front.
+*/
+void water_plane::spawnBatch(const std::vector<waveParticle>& batch, bool closed) {
+	waveFront front;
+	front.closed = closed;
+	for (int i = 0; i < batch.size(); i++) {
+		front.ids.push_back(newParticle(batch[i]));
+	}
+	if (front.ids.size() > 0) {
+		waveFronts.push_back(front);
 	}
+}
+
+/*
+Emits a closed ring of particles moving out from centre.
+*/
+int water_plane::emitRing(glm::vec2 centre, float ringRadius, float amplitude, float resolveRadius) {
+	float pi = 3.141592;
+	return emitArc(centre, ringRadius, 0, 2 * pi, amplitude, resolveRadius);
+}
+
+/*
+Emits the part of a ring between two angles (radians), as an open front unless it is a full turn.
+*/
+int water_plane::emitArc(glm::vec2 centre, float ringRadius, float startAngle, float endAngle, float amplitude, float resolveRadius) {
+	float pi = 3.141592;
+	float sweep = endAngle - startAngle;
+	bool closed = abs(sweep) >= 2 * pi - 1e-4f;
+	float reach = std::max(std::max(ringRadius, resolveRadius), 1e-3f);
+	int segments = std::max(closed ? 3 : 1, (int)ceil(abs(sweep) * reach / (0.5f * radius)));
+	int count = closed ? segments : segments + 1;
 
-	waveFronts.push_back(wf);
+	waveFront& front = bulkFront(count, closed);
+	for (int i = 0; i < count; i++) {
+		float angle = startAngle + sweep * (float(i) / segments);
+		waveParticle& p = particles[front.ids[i]];
+		p.direction = vec2(cos(angle), sin(angle));
+		p.origin = centre;
+		p.position = centre + p.direction * ringRadius;
+		p.amplitude = amplitude;
+		p.radius = radius;
+		p.speed = speed;
+		p.dispAng = degrees(angle);
+	}
+	binFront(front);
+	return count;
 }
 
+/*
+Emits a straight open front from a to b with every particle travelling along dir.
+*/
+int water_plane::emitLine(glm::vec2 a, glm::vec2 b, glm::vec2 dir, float amplitude) {
+	int segments = std::max(1, (int)ceil(distance(a, b) / (0.5f * radius)));
+	int count = segments + 1;
+
+	waveFront& front = bulkFront(count, false);
+	for (int i = 0; i < count; i++) {
+		waveParticle& p = particles[front.ids[i]];
+		p.position = mix(a, b, float(i) / segments);
+		p.origin = p.position;
+		p.direction = normalize(dir);
+		p.amplitude = amplitude;
+		p.radius = radius;
+		p.speed = speed;
+		p.dispAng = 0;
+	}
+	binFront(front);
+	return count;
+}
+
+/*
+Appends a new front backed by one contiguous block of count fresh particles.
+*/
+waveFront& water_plane::bulkFront(int count, bool closed) {
+	int first = particles.size();
+	particles.resize(first + count);
+	waveFronts.emplace_back();
+	waveFront& front = waveFronts.back();
+	front.closed = closed;
+	front.ids.resize(count);
+	for (int i = 0; i < count; i++) {
+		front.ids[i] = first + i;
+	}
+	return front;
+}
+
+/*
+Bins freshly emitted particles, the ones already outside the water are culled next tick.
+*/
+void water_plane::binFront(const waveFront& front) {
+	for (int id : front.ids) {
+		particles[id].cell = -1;
+		vec2 shift = wrapOffset(particles[id].position);
+		particles[id].position += shift;
+		particles[id].origin += shift;
+		int c = cellOf(particles[id].position);
+		if (c >= 0) {
+			int band = bandOf(particles[id]);
+			if (band == 0) bin(id, c);
+			markTiles(c / n, c % n, activeTiles, bandReach(band));
+		}
+	}
+}
+
+/*
+Splits the fronts wherever neighbouring particles have drifted too far apart,
+halving the amplitude on both sides of the gap and inserting a new particle between them.
+*/
 void water_plane::generateWaveParticles() {
 	for (int i = 0; i < waveFronts.size(); i++) {
+		const vector<int>& front = waveFronts[i].ids;
+		int count = front.size();
+		int gaps = waveFronts[i].closed ? count : count - 1;
+		vector<float> amps(count);
+		for (int j = 0; j < count; j++) {
+			amps[j] = particles[front[j]].amplitude;
+		}
 
-		vector<waveParticle> wf;
-		for (int j = 1; j <= waveFronts[i].size(); j++) {
-			waveParticle p1 = waveFronts[i][j-1];
+		vector<int> wf;
+		wf.push_back(front[0]);
+		for (int j = 1; j <= gaps; j++) {
+			int a = front[j - 1];
+			int b = front[j % count];
 
-			waveParticle p2;
-			if (j == waveFronts[i].size()) {
-				p2 = waveFronts[i][0];
-			}
-			else {
-				p2 = waveFronts[i][j];
-			}
-
-			if (distance(p1.position, p2.position) > 0.5*p1.radius) {
+			if (separation(particles[a].position, particles[b].position) > 0.5 * particles[a].radius) {
 				float d = 2;
+				const waveParticle& p1 = particles[a];
+				const waveParticle& p2 = particles[b];
 				waveParticle mid;
-				p1.amplitude /= d;
-				p2.amplitude /= d;
-				mid.amplitude = p2.amplitude;
-				vec2 m = (p2.position + p1.position) / 2.f;
+				mid.amplitude = amps[j % count] / d;
+				mid.radius = p1.radius;
+				mid.speed = p1.speed;
 				vec2 dir = normalize((p1.direction + p2.direction) / 2.f);
 				vec2 midP = p2.origin + (dir * distance(p2.origin, p2.position));
 				mid.origin = p2.origin;
@@ -336,19 +1821,17 @@ void water_plane::generateWaveParticles() {
 				mid.position = midP;
 				mid.dispAng = p1.dispAng + 0.5f * (p2.dispAng - p1.dispAng);
 				if (j == 1) {
-					wf.push_back(p1);
+					particles[a].amplitude = amps[0] / d;
 				}
-				wf.push_back(mid);
-			}
-			else {
-				if (j == 1) {
-					wf.push_back(p1);
+				wf.push_back(newParticle(mid));
+				if (j < count) {
+					particles[b].amplitude = amps[j] / d;
 				}
 			}
-			if (j < waveFronts[i].size()) {
-				wf.push_back(p2);
+			if (j < count) {
+				wf.push_back(b);
 			}
 		}
-		waveFronts[i] = wf;
+		waveFronts[i].ids = wf;
 	}
-}
\ No newline at end of file
+}
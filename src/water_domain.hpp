@@ -0,0 +1,386 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// project
+#include "water.hpp"
+
+
+//Water split into tiles x tiles independently simulated water_planes, stepped in parallel.
+//Each plane has its own particle store and cells and covers its tile plus a halo of
+//`halo` cells on every side, in local coordinates centred on the tile. Particles that end a
+//step in the halo are handed over to the tile that owns them, and copies of the neighbours'
+//particles near the shared edges are placed in the halo as ghosts, so heights along the tile
+//edges see the same particles as a single plane would. Ghosts are never advected or split.
+//A domain can own only some of the tiles (see water_shard.hpp), the planes of the others are
+//null and whatever crosses into them is left in the outboxes and ghost lists for the caller to send.
+struct water_domain {
+	int n = 0; //cells per side of the whole domain
+	int tiles = 1; //tiles per side
+	int tileCells = 0; //cells per side of one tile
+	int halo = 0; //halo width in cells, the reach of the eta() lookup window
+	float width = 100;
+	float step = 1;
+	int ticks = 0;
+	std::vector<std::unique_ptr<water_plane>> planes; //row major, tile (a, b) covers rows a*tileCells.. and columns b*tileCells.., null if not owned
+	std::vector<float> heightMap; //n x n heights of the whole domain, row major
+	std::default_random_engine rng;
+
+	//Fronts leaving each plane this step, tagged with the plane they move to.
+	std::vector<std::vector<std::pair<int, waveEvent>>> outbox;
+	std::vector<std::vector<waveEvent>> arrivals; //fronts handed over by tiles owned elsewhere
+	std::vector<std::vector<int>> ghosts; //ghost particle ids per plane
+	std::vector<std::vector<waveParticle>> incoming; //ghosts gathered for each plane
+
+	//size is rounded up to a multiple of the tile count, params supplies the simulation parameters.
+	//owned selects the tiles simulated here (tiles x tiles flags), empty for all of them.
+	water_domain(int size, float halfWidth, int tileCount, const water_plane& params, const std::vector<bool>& owned = std::vector<bool>());
+	//Advances every tile one step and assembles heightMap
+	void tick();
+	//The phases of tick(), in order. deliver() follows applyEvents() and advance(), which leave
+	//fronts for other tiles in the outboxes; gatherHalos() fills incoming from owned neighbours.
+	void applyEvents();
+	void advance();
+	void deliver();
+	void gatherHalos();
+	void evaluate();
+	//Queues a wave in domain coordinates on the tile containing its position
+	void addWave(waveEvent e);
+	void randWave(float waveRadius = 0);
+	int particleCount() const;
+
+	glm::vec2 centre(int t) const;
+	int tileOf(glm::vec2 position) const;
+	int owner(int t, const waveParticle& p) const;
+	void migrate(int t, int firstFront);
+	void receive(int t);
+	void gatherGhosts(int t);
+	void collectGhosts(int s, int t, std::vector<waveParticle>& out) const;
+	void placeGhosts(int t);
+};
+
+//======================================================================= METHODS FOR WATER DOMAIN ======================================================================
+
+water_domain::water_domain(int size, float halfWidth, int tileCount, const water_plane& params, const std::vector<bool>& owned) {
+	tiles = std::max(tileCount, 1);
+	tileCells = (std::max(size, 1) + tiles - 1) / tiles;
+	n = tileCells * tiles;
+	width = halfWidth;
+	step = 2 * width / n;
+	halo = std::min(std::max((int)std::ceil(params.adjacent), 1), tileCells);
+
+	int local = tileCells + 2 * halo;
+	for (int t = 0; t < tiles * tiles; t++) {
+		if (!owned.empty() && !owned[t]) {
+			planes.emplace_back();
+			continue;
+		}
+		std::unique_ptr<water_plane> p(new water_plane());
+		p->threshold = params.threshold;
+		p->baseHeight = params.baseHeight;
+		p->baseAmp = params.baseAmp;
+		p->waveRate = params.waveRate;
+		p->roughness = params.roughness;
+		p->damping = params.damping;
+		p->adjacent = params.adjacent;
+		p->radius = params.radius;
+		p->speed = params.speed;
+		p->rate = params.rate;
+		p->compactRate = params.compactRate;
+		p->mortonOrder = params.mortonOrder;
+		p->width = local * step / 2;
+		p->resize(local);
+		planes.push_back(std::move(p));
+	}
+	heightMap.assign(n * n, params.baseHeight);
+	outbox.resize(planes.size());
+	arrivals.resize(planes.size());
+	ghosts.resize(planes.size());
+	incoming.resize(planes.size());
+}
+
+/*
+Centre of tile t in domain coordinates. Adding it takes a position from the tile's local coordinates to the domain's.
+*/
+glm::vec2 water_domain::centre(int t) const {
+	int a = t / tiles;
+	int b = t % tiles;
+	return vec2(-width + (a + 0.5f) * tileCells * step, -width + (b + 0.5f) * tileCells * step);
+}
+
+/*
+Tile containing a position in domain coordinates, positions outside are clamped to the edge tiles.
+*/
+int water_domain::tileOf(glm::vec2 position) const {
+	int gi = std::min(std::max(int((position.x + width) / step), 0), n - 1);
+	int gj = std::min(std::max(int((position.y + width) / step), 0), n - 1);
+	return (gi / tileCells) * tiles + gj / tileCells;
+}
+
+/*
+Plane that owns a particle of plane t, or -1 if it has left the domain.
+Binned particles are assigned by their cell so ownership matches the cell grid exactly.
+*/
+int water_domain::owner(int t, const waveParticle& p) const {
+	int gi, gj;
+	if (p.cell >= 0) {
+		int local = planes[t]->n;
+		gi = (t / tiles) * tileCells + p.cell / local - halo;
+		gj = (t % tiles) * tileCells + p.cell % local - halo;
+	}
+	else {
+		vec2 g = p.position + centre(t);
+		if (!(g.x < width && g.y < width && g.x > -width && g.y > -width)) return -1;
+		gi = std::min(int((g.x + width) / step), n - 1);
+		gj = std::min(int((g.y + width) / step), n - 1);
+	}
+	if (gi < 0 || gj < 0 || gi >= n || gj >= n) return -1;
+	return (gi / tileCells) * tiles + gj / tileCells;
+}
+
+/*
+Removes particles that plane t no longer owns from its fronts (from firstFront on). Fronts are cut
+into runs by owner; runs that stay become local fronts, runs that leave go to the outbox as open
+batches in the receiving plane's coordinates, and particles that left the domain are dropped.
+*/
+void water_domain::migrate(int t, int firstFront) {
+	water_plane& p = *planes[t];
+	std::vector<waveFront> pieces;
+	std::vector<int> dest;
+	for (int f = firstFront; f < int(p.waveFronts.size()); f++) {
+		waveFront& wf = p.waveFronts[f];
+		int count = wf.ids.size();
+		dest.resize(count);
+		bool stays = true;
+		for (int k = 0; k < count; k++) {
+			dest[k] = owner(t, p.particles[wf.ids[k]]);
+			stays = stays && dest[k] == t;
+		}
+		if (stays) continue;
+
+		bool whole = std::all_of(dest.begin(), dest.end(), [&](int d) { return d == dest[0]; });
+		if (wf.closed && !whole) {
+			//start at a change of owner so no run wraps around the end
+			int s = 1;
+			while (dest[s] == dest[s - 1]) s++;
+			std::rotate(wf.ids.begin(), wf.ids.begin() + s, wf.ids.end());
+			std::rotate(dest.begin(), dest.begin() + s, dest.end());
+		}
+
+		for (int k = 0; k < count;) {
+			int e = k;
+			while (e < count && dest[e] == dest[k]) e++;
+			if (dest[k] == t) {
+				waveFront piece;
+				piece.closed = false;
+				piece.ids.assign(wf.ids.begin() + k, wf.ids.begin() + e);
+				pieces.push_back(std::move(piece));
+			}
+			else {
+				if (dest[k] >= 0) {
+					waveEvent ev;
+					ev.kind = waveEvent::batch;
+					ev.closed = wf.closed && whole;
+					vec2 shift = centre(t) - centre(dest[k]);
+					for (int i = k; i < e; i++) {
+						waveParticle q = p.particles[wf.ids[i]];
+						q.position += shift;
+						q.origin += shift;
+						ev.particles.push_back(q);
+					}
+					outbox[t].push_back(std::make_pair(dest[k], std::move(ev)));
+				}
+				for (int i = k; i < e; i++) p.killParticle(wf.ids[i]);
+			}
+			k = e;
+		}
+		wf.ids.clear();
+	}
+	p.waveFronts.erase(std::remove_if(p.waveFronts.begin() + firstFront, p.waveFronts.end(), [](const waveFront& wf) { return wf.ids.empty(); }), p.waveFronts.end());
+	for (auto& piece : pieces) p.waveFronts.push_back(std::move(piece));
+}
+
+/*
+Adds the fronts other planes handed to plane t, in plane order so runs are deterministic,
+followed by the ones that arrived from tiles owned elsewhere.
+*/
+void water_domain::receive(int t) {
+	for (int s = 0; s < int(planes.size()); s++) {
+		for (auto& m : outbox[s]) {
+			if (m.first == t) planes[t]->spawnBatch(m.second.particles, m.second.closed);
+		}
+	}
+	for (auto& e : arrivals[t]) {
+		planes[t]->spawnBatch(e.particles, e.closed);
+	}
+}
+
+/*
+Copies the particles of the owned neighbouring planes that lie inside plane t's halo.
+Only reads the neighbours, the copies are placed by placeGhosts() once every plane is done.
+*/
+void water_domain::gatherGhosts(int t) {
+	int a = t / tiles;
+	int b = t % tiles;
+	incoming[t].clear();
+	for (int na = std::max(a - 1, 0); na <= std::min(a + 1, tiles - 1); na++) {
+		for (int nb = std::max(b - 1, 0); nb <= std::min(b + 1, tiles - 1); nb++) {
+			int s = na * tiles + nb;
+			if (s != t && planes[s]) collectGhosts(s, t, incoming[t]);
+		}
+	}
+}
+
+/*
+Appends the particles of plane s inside the halo of tile t, in tile t's coordinates.
+*/
+void water_domain::collectGhosts(int s, int t, std::vector<waveParticle>& out) const {
+	int a = t / tiles, b = t % tiles;
+	int na = s / tiles, nb = s % tiles;
+	const water_plane& p = *planes[s];
+	vec2 shift = centre(s) - centre(t);
+	//global cells inside both tile t's halo and tile s
+	int i0 = std::max(a * tileCells - halo, na * tileCells);
+	int i1 = std::min((a + 1) * tileCells + halo, (na + 1) * tileCells);
+	int j0 = std::max(b * tileCells - halo, nb * tileCells);
+	int j1 = std::min((b + 1) * tileCells + halo, (nb + 1) * tileCells);
+	for (int i = i0; i < i1; i++) {
+		for (int j = j0; j < j1; j++) {
+			int c = (i - na * tileCells + halo) * p.n + (j - nb * tileCells + halo);
+			for (int id : p.cellMap[c]) {
+				waveParticle q = p.particles[id];
+				q.position += shift;
+				q.origin += shift;
+				out.push_back(q);
+			}
+		}
+	}
+}
+
+void water_domain::placeGhosts(int t) {
+	water_plane& p = *planes[t];
+	for (const waveParticle& q : incoming[t]) {
+		ghosts[t].push_back(p.newParticle(q));
+	}
+}
+
+/*
+One step of the whole domain. Every phase runs the planes in parallel and only touches the
+plane it is given, anything crossing planes goes through the outboxes and ghost lists
+between phases.
+*/
+void water_domain::tick() {
+	applyEvents();
+	deliver();
+	advance();
+	deliver();
+	gatherHalos();
+	evaluate();
+}
+
+/*
+Drops last step's ghosts and applies queued waves, handing over particles emitted outside the tile.
+*/
+void water_domain::applyEvents() {
+	#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < int(planes.size()); t++) {
+		if (!planes[t]) continue;
+		water_plane& p = *planes[t];
+		for (int id : ghosts[t]) p.killParticle(id);
+		ghosts[t].clear();
+		int fronts = p.waveFronts.size();
+		p.drainEvents();
+		migrate(t, fronts);
+	}
+}
+
+/*
+Advects and subdivides, handing over particles that crossed a tile edge.
+*/
+void water_domain::advance() {
+	#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < int(planes.size()); t++) {
+		if (!planes[t]) continue;
+		planes[t]->iterate();
+		planes[t]->generateWaveParticles();
+		migrate(t, 0);
+	}
+}
+
+/*
+Moves the handed over fronts into the planes that own them and empties the outboxes.
+*/
+void water_domain::deliver() {
+	#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < int(planes.size()); t++) {
+		if (planes[t]) receive(t);
+	}
+	for (auto& o : outbox) o.clear();
+	for (auto& a : arrivals) a.clear();
+}
+
+void water_domain::gatherHalos() {
+	#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < int(planes.size()); t++) {
+		if (planes[t]) gatherGhosts(t);
+	}
+}
+
+/*
+Places the ghosts, evaluates heights and copies the interior of every owned tile into heightMap.
+*/
+void water_domain::evaluate() {
+	#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < int(planes.size()); t++) {
+		if (!planes[t]) continue;
+		placeGhosts(t);
+		planes[t]->getHMap();
+
+		const water_plane& p = *planes[t];
+		int a = t / tiles;
+		int b = t % tiles;
+		for (int i = 0; i < tileCells; i++) {
+			std::memcpy(&heightMap[(a * tileCells + i) * n + b * tileCells], &p.heightMap[(i + halo) * p.n + halo], tileCells * sizeof(float));
+		}
+	}
+	ticks++;
+}
+
+void water_domain::addWave(waveEvent e) {
+	int t = tileOf(e.position);
+	if (!planes[t]) return;
+	vec2 shift = centre(t);
+	e.position -= shift;
+	for (waveParticle& q : e.particles) {
+		q.position -= shift;
+		q.origin -= shift;
+	}
+	planes[t]->addWave(std::move(e));
+}
+
+void water_domain::randWave(float waveRadius) {
+	std::uniform_real_distribution<float> dist(0, 2 * width);
+	float ri = dist(rng);
+	float rj = dist(rng);
+	waveEvent e;
+	e.kind = waveEvent::ring;
+	e.position = vec2(-width, -width) + vec2(ri, rj);
+	e.length = 2 * width / n;
+	e.radius = waveRadius;
+	addWave(std::move(e));
+}
+
+int water_domain::particleCount() const {
+	int total = 0;
+	for (auto& p : planes) {
+		if (!p) continue;
+		for (auto& wf : p->waveFronts) total += wf.ids.size();
+	}
+	return total;
+}
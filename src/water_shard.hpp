@@ -0,0 +1,338 @@
+#pragma once
+
+// std
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// project
+#include "shard_transport.hpp"
+#include "water_domain.hpp"
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+
+//Values and particle runs packed into a transport message.
+struct shard_message {
+	std::vector<char> data;
+	size_t read = 0;
+
+	template <typename T> void put(const T& v) {
+		const char* p = reinterpret_cast<const char*>(&v);
+		data.insert(data.end(), p, p + sizeof(T));
+	}
+	template <typename T> T get() {
+		if (read + sizeof(T) > data.size()) throw std::runtime_error("Error: Truncated shard message");
+		T v;
+		std::memcpy(&v, &data[read], sizeof(T));
+		read += sizeof(T);
+		return v;
+	}
+	void putParticles(const std::vector<waveParticle>& particles);
+	std::vector<waveParticle> getParticles();
+	void putEvent(const waveEvent& e);
+	waveEvent getEvent();
+	bool done() const { return read >= data.size(); }
+	void clear() { data.clear(); read = 0; }
+};
+
+
+#ifndef _WIN32
+
+//A tiled water domain sharded across worker processes. The tiles are dealt out to the workers in
+//contiguous row major runs and every worker steps its tiles with a water_domain that owns only
+//those. Fronts and ghosts crossing into another worker's tiles are sent to this coordinator
+//each phase, which forwards them to the owner, and the workers send back their tiles' heights.
+//Workers are forked, so this must be created before anything starts OpenMP threads.
+struct water_shards {
+	water_domain layout; //owns no planes, holds the tile layout, rng and the assembled heightMap
+	std::vector<int> shardOf; //worker of each tile
+	std::vector<std::unique_ptr<shard_transport>> links; //one per worker
+	std::vector<pid_t> workers;
+	std::vector<std::vector<waveEvent>> events; //queued waves per worker
+
+	water_shards(int size, float halfWidth, int tileCount, int shardCount, const water_plane& params);
+	~water_shards();
+	void addWave(waveEvent e);
+	void randWave(float waveRadius = 0);
+	void tick();
+	void route();
+};
+
+//Serves tick requests from the coordinator until the link is closed.
+void runShardWorker(shard_transport& link, water_domain& domain);
+
+#endif
+
+//======================================================================= METHODS FOR WATER SHARDS ======================================================================
+
+void shard_message::putParticles(const std::vector<waveParticle>& particles) {
+	put<int32_t>(particles.size());
+	const char* p = reinterpret_cast<const char*>(particles.data());
+	data.insert(data.end(), p, p + particles.size() * sizeof(waveParticle));
+}
+
+std::vector<waveParticle> shard_message::getParticles() {
+	int32_t count = get<int32_t>();
+	if (count < 0 || read + count * sizeof(waveParticle) > data.size()) throw std::runtime_error("Error: Truncated shard message");
+	std::vector<waveParticle> particles(count);
+	std::memcpy(particles.data(), &data[read], count * sizeof(waveParticle));
+	read += count * sizeof(waveParticle);
+	return particles;
+}
+
+void shard_message::putEvent(const waveEvent& e) {
+	put<int32_t>(e.kind);
+	put(e.position);
+	put(e.direction);
+	put(e.length);
+	put(e.startAngle);
+	put(e.endAngle);
+	put(e.amplitude);
+	put(e.radius);
+	put<int32_t>(e.closed);
+	putParticles(e.particles);
+}
+
+waveEvent shard_message::getEvent() {
+	waveEvent e;
+	e.kind = waveEvent::kind_t(get<int32_t>());
+	e.position = get<glm::vec2>();
+	e.direction = get<glm::vec2>();
+	e.length = get<float>();
+	e.startAngle = get<float>();
+	e.endAngle = get<float>();
+	e.amplitude = get<float>();
+	e.radius = get<float>();
+	e.closed = get<int32_t>() != 0;
+	e.particles = getParticles();
+	return e;
+}
+
+#ifndef _WIN32
+
+namespace {
+	//Sends the fronts leaving for tiles this worker does not own as [tile][closed][particles]
+	//records and files the ones the coordinator forwards back under arrivals.
+	void exchangeFronts(shard_transport& link, water_domain& domain) {
+		shard_message out;
+		for (auto& o : domain.outbox) {
+			for (auto& m : o) {
+				if (domain.planes[m.first]) continue;
+				out.put<int32_t>(m.first);
+				out.put<int32_t>(m.second.closed);
+				out.putParticles(m.second.particles);
+			}
+			o.erase(std::remove_if(o.begin(), o.end(), [&](const std::pair<int, waveEvent>& m) { return !domain.planes[m.first]; }), o.end());
+		}
+		link.send(out.data);
+
+		shard_message in;
+		if (!link.receive(in.data)) throw std::runtime_error("Error: Shard coordinator closed the link");
+		while (!in.done()) {
+			waveEvent e;
+			int tile = in.get<int32_t>();
+			e.kind = waveEvent::batch;
+			e.closed = in.get<int32_t>() != 0;
+			e.particles = in.getParticles();
+			domain.arrivals.at(tile).push_back(std::move(e));
+		}
+	}
+
+	//Sends the edge particles of owned tiles that lie in the halo of neighbouring tiles owned elsewhere,
+	//and adds the ones received to the ghosts gathered for the owned tiles.
+	void exchangeGhosts(shard_transport& link, water_domain& domain) {
+		shard_message out;
+		std::vector<waveParticle> halo;
+		for (int s = 0; s < int(domain.planes.size()); s++) {
+			if (!domain.planes[s]) continue;
+			int a = s / domain.tiles;
+			int b = s % domain.tiles;
+			for (int na = std::max(a - 1, 0); na <= std::min(a + 1, domain.tiles - 1); na++) {
+				for (int nb = std::max(b - 1, 0); nb <= std::min(b + 1, domain.tiles - 1); nb++) {
+					int t = na * domain.tiles + nb;
+					if (domain.planes[t]) continue;
+					halo.clear();
+					domain.collectGhosts(s, t, halo);
+					if (halo.empty()) continue;
+					out.put<int32_t>(t);
+					out.put<int32_t>(0);
+					out.putParticles(halo);
+				}
+			}
+		}
+		link.send(out.data);
+
+		shard_message in;
+		if (!link.receive(in.data)) throw std::runtime_error("Error: Shard coordinator closed the link");
+		while (!in.done()) {
+			int tile = in.get<int32_t>();
+			in.get<int32_t>();
+			std::vector<waveParticle> ghosts = in.getParticles();
+			std::vector<waveParticle>& incoming = domain.incoming.at(tile);
+			incoming.insert(incoming.end(), ghosts.begin(), ghosts.end());
+		}
+	}
+}
+
+void runShardWorker(shard_transport& link, water_domain& domain) {
+	shard_message in;
+	while (link.receive(in.data)) {
+		in.read = 0;
+		int count = in.get<int32_t>();
+		for (int i = 0; i < count; i++) {
+			domain.addWave(in.getEvent());
+		}
+
+		domain.applyEvents();
+		exchangeFronts(link, domain);
+		domain.deliver();
+		domain.advance();
+		exchangeFronts(link, domain);
+		domain.deliver();
+		domain.gatherHalos();
+		exchangeGhosts(link, domain);
+		domain.evaluate();
+
+		//heights of the owned tiles as [tile][tileCells x tileCells floats]
+		shard_message out;
+		for (int t = 0; t < int(domain.planes.size()); t++) {
+			if (!domain.planes[t]) continue;
+			out.put<int32_t>(t);
+			int a = t / domain.tiles;
+			int b = t % domain.tiles;
+			for (int i = 0; i < domain.tileCells; i++) {
+				const char* row = reinterpret_cast<const char*>(&domain.heightMap[(a * domain.tileCells + i) * domain.n + b * domain.tileCells]);
+				out.data.insert(out.data.end(), row, row + domain.tileCells * sizeof(float));
+			}
+		}
+		link.send(out.data);
+	}
+}
+
+water_shards::water_shards(int size, float halfWidth, int tileCount, int shardCount, const water_plane& params)
+	: layout(size, halfWidth, tileCount, params, std::vector<bool>(tileCount * tileCount, false))
+{
+	int tileTotal = layout.tiles * layout.tiles;
+	shardCount = std::min(std::max(shardCount, 1), tileTotal);
+	for (int t = 0; t < tileTotal; t++) {
+		shardOf.push_back(t * shardCount / tileTotal);
+	}
+	events.resize(shardCount);
+
+	for (int k = 0; k < shardCount; k++) {
+		auto ends = socket_transport::pair();
+		pid_t pid = fork();
+		if (pid < 0) {
+			std::cerr << "Error: Could not start shard worker " << k << std::endl;
+			throw std::runtime_error("Error: Could not start shard worker");
+		}
+		if (pid == 0) {
+			//drop the coordinator's ends so every worker sees its link close
+			links.clear();
+			ends.first.reset();
+			int status = 0;
+			try {
+				std::vector<bool> owned(tileTotal);
+				for (int t = 0; t < tileTotal; t++) owned[t] = shardOf[t] == k;
+				water_domain domain(size, halfWidth, tileCount, params, owned);
+				runShardWorker(*ends.second, domain);
+			}
+			catch (std::exception& e) {
+				std::cerr << "Shard worker " << k << ": " << e.what() << std::endl;
+				status = 1;
+			}
+			_exit(status);
+		}
+		ends.second.reset();
+		links.push_back(std::move(ends.first));
+		workers.push_back(pid);
+	}
+}
+
+water_shards::~water_shards() {
+	links.clear();
+	for (pid_t pid : workers) waitpid(pid, nullptr, 0);
+}
+
+void water_shards::addWave(waveEvent e) {
+	events[shardOf[layout.tileOf(e.position)]].push_back(std::move(e));
+}
+
+void water_shards::randWave(float waveRadius) {
+	std::uniform_real_distribution<float> dist(0, 2 * layout.width);
+	float ri = dist(layout.rng);
+	float rj = dist(layout.rng);
+	waveEvent e;
+	e.kind = waveEvent::ring;
+	e.position = vec2(-layout.width, -layout.width) + vec2(ri, rj);
+	e.length = 2 * layout.width / layout.n;
+	e.radius = waveRadius;
+	addWave(std::move(e));
+}
+
+/*
+Forwards the records every worker sent this phase to the workers owning their tiles, in worker order.
+*/
+void water_shards::route() {
+	std::vector<shard_message> out(links.size());
+	shard_message in;
+	for (auto& link : links) {
+		in.clear();
+		if (!link->receive(in.data)) throw std::runtime_error("Error: Shard worker closed the link");
+		while (!in.done()) {
+			size_t start = in.read;
+			int tile = in.get<int32_t>();
+			in.get<int32_t>();
+			in.getParticles();
+			std::vector<char>& dest = out[shardOf.at(tile)].data;
+			dest.insert(dest.end(), in.data.begin() + start, in.data.begin() + in.read);
+		}
+	}
+	for (int k = 0; k < int(links.size()); k++) {
+		links[k]->send(out[k].data);
+	}
+}
+
+/*
+One step of every worker: the queued waves go out with the request, then fronts are routed
+twice (after the waves and after advection), ghosts once, and the heights are collected.
+*/
+void water_shards::tick() {
+	for (int k = 0; k < int(links.size()); k++) {
+		shard_message request;
+		request.put<int32_t>(events[k].size());
+		for (auto& e : events[k]) request.putEvent(e);
+		events[k].clear();
+		links[k]->send(request.data);
+	}
+	route();
+	route();
+	route();
+
+	int tc = layout.tileCells;
+	shard_message in;
+	for (auto& link : links) {
+		in.clear();
+		if (!link->receive(in.data)) throw std::runtime_error("Error: Shard worker closed the link");
+		while (!in.done()) {
+			int t = in.get<int32_t>();
+			if (t < 0 || t >= int(shardOf.size()) || in.read + tc * tc * sizeof(float) > in.data.size()) throw std::runtime_error("Error: Corrupt shard heights");
+			int a = t / layout.tiles;
+			int b = t % layout.tiles;
+			for (int i = 0; i < tc; i++) {
+				std::memcpy(&layout.heightMap[(a * tc + i) * layout.n + b * tc], &in.data[in.read], tc * sizeof(float));
+				in.read += tc * sizeof(float);
+			}
+		}
+	}
+	layout.ticks++;
+}
+
+#endif